@@ -5,10 +5,47 @@
 
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <climits>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <queue>
+#include <tuple>
+#include <fstream>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <memory>
+#include <sstream>
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // file mapping for the match cache
+#include <psapi.h> // peak working set
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/core.hpp> // OpenCV Core Functionality
 #include <opencv2/highgui/highgui.hpp> // High-Level Graphical User Interface
 #include "opencv2/features2d.hpp" 
+#include <opencv2/core/hal/hal.hpp> // hal::normHamming
+#include <opencv2/stitching/detail/autocalib.hpp> // focal length from a rotation homography
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h> // SIMD popcount for the Hamming matcher
+#endif
 
 using namespace std;
 using namespace std::chrono;
@@ -21,35 +58,91 @@ using namespace cv;
 #define STEP3					1 //find optimal "path" to stich all  images 
 #define STEP4					1 //perform stiching
 #define SAVE_OUTPUT				1
+#define STREAMING_MODE			0 // Stitch frames one at a time as they arrive instead of running Steps 1-3 on a batch
+#define STREAM_SOURCE			"" // Video file to stitch in streaming mode, empty watches the FOLDER for new images
+#define STREAM_WINDOW			4 // Recent frames each new frame is matched against
+#define STREAM_MAX_KEYFRAMES	8 // Keyframes kept for matching besides the window, oldest dropped first
+#define STREAM_KEYFRAME_INLIERS	30 // A frame becomes a keyframe once it shares fewer inliers than this with the newest keyframe
+#define STREAM_POLL_MS			200 // How often the folder is checked for new frames
+#define STREAM_IDLE_TIMEOUT_MS	5000 // Streaming stops after this long without a new frame
+#define STREAM_MAX_CANVAS_SIDE	16000 // Frames that would grow the panorama past this are dropped, capping it at 16000^2 x 4 bytes (1 GB)
+#define SERVICE_CONCURRENT_JOBS	2 // Jobs --service runs at once, their batches take turns on the shared worker pool
+#define SERVICE_MATCHING_THRESHOLD	3300 // imageMatchingThreshold of service jobs that don't set one
+#define TILED_OUTPUT			0 // Render the panorama tile by tile into TILE_OUTPUT_FOLDER instead of one Mat in memory
+#define OUTPUT_TILE_SIZE		1024 // Side of each output tile in pixels
+#define TILE_OUTPUT_FOLDER		"CompositeTiles"
+#define PROJECTION				0 // Surface the composite is rendered on: 0 planar (the center image's plane), 1 cylindrical, 2 spherical
+#define PROJECTION_EDGE_SAMPLES	32 // Points along each side of an image projected to find its extent on a curved surface
 
 #define RESCALE_ON_LOAD			0.3 // Rescaling the images for faster program (1 is no rescalling, 0.5 is half, etc)
+#define COMPOSITE_SCALE			RESCALE_ON_LOAD // Scale the composite is rendered at, a different one refines the homographies found at RESCALE_ON_LOAD to it
+#define REFINE_POINTS			32 // Best inlier matches per assembly edge re-located at the composite scale
+#define REFINE_PATCH_SIZE		21 // Side of the patch correlated around each of them
+#define REFINE_MIN_CORRELATION	0.8 // Weaker correlation peaks are discarded
+#define REFINE_MIN_POINTS		8 // With fewer re-located points the edge keeps its lifted homography
 #define UNDISTORT_ON_LOAD		0
-#define SMART_ADD_GAUSIAN_BLUR	101
+#define CAMERA_CALIBRATION_FILE	"camera.yml" // camera_matrix, distortion_coefficients, image_width, image_height as written by OpenCV's calibration sample
+#define FUSE_UNDISTORT_RESCALE	1 // Undistort and finish the rescale in the same remap instead of a resize followed by a remap
+#define LAZY_IMAGE_PIXELS		1 // Drop each image's pixels once its features are extracted, reload them from the file when needed
+#define FEATHER_WIDTH			150 // Pixels from an image's edge over which its blend weight ramps up to full
+#define BLEND_ROWS_PER_TASK		32 // Rows each worker takes at a time in the blend kernel
+#define ACCUMULATOR_MAX_BYTES	(512 << 20) // Canvases whose 16 byte per pixel accumulator would be bigger are composited a band of rows at a time
 
 #define PIXEL_PADDING			600 //how many pixels should pad each image 
+#define MAX_CANVAS_SIDE			30000 // Images whose warp would be wider or taller than this are left out
 #define PADDING_AMMOUNT			2
 #define PADDING_OFFSET			2
 
-#define ORB_POINT_COUNT		500 //how many orb poitns to find
+#define ORB_POINT_COUNT		500 //how many orb poitns to find, at most
+#define ORB_MIN_POINT_COUNT		150 // Budget for an image with almost no texture, the budget grows with its textured area
+#define ORB_CANDIDATE_FACTOR	3 // ORB detects this many times the budget, bucketing then keeps the best spread of them
+#define FEATURE_GRID_SIZE		8 // Keypoints are bucketed into an N x N grid over each image so they can't all cluster
+#define HOMOGRAPHY_MATCHES		60 // Best ranked matches handed to the homography solver
+#define HOMOGRAPHY_THRESHOLD	5.0 // Reprojection error in pixels for a match to count as an inlier
+#define HOMOGRAPHY_CONFIDENCE	0.995 // The solver stops once it is this sure no better model is left to find
+#define HOMOGRAPHY_MAX_ITERATIONS	2000
+#define HOMOGRAPHY_SOLVER_VERSION	1 // Bump with any change to the solver itself, so the match cache drops homographies from the old one
+#define WORKER_THREADS			0 // Threads in the worker pool (0 uses every core)
+#define LOADER_THREADS			0 // Threads decoding image files (0 uses half the cores)
+#define PREFETCH_QUEUE_SIZE		8 // Most decoded images waiting to be picked up by the worker pool
+
+#define EXHAUSTIVE_MATCHING_LIMIT	30 // Sets with this many images or fewer match every pair
+#define CANDIDATE_NEIGHBOURS		6 // Bigger sets only match each image against its k most similar images
+#define VOCABULARY_SIZE			256 // Visual words in the bag-of-binary-words index used to rank candidates
+#define VOCABULARY_SAMPLES		20000 // Descriptors sampled across the set to train the vocabulary
+#define VOCABULARY_ITERATIONS	5 // k-majority clustering rounds
+#define UNMATCHED_MATCH_SCORE	66049 // Score given to pairs that were never matched, (1 + 256)^2 is the worst possible
+#define MATCH_RATIO_TEST		0.8 // Keep a match only if its distance is below this fraction of the second best
+#define MATCH_CROSS_CHECK		1 // Keep a match only if it is also the best match in the other direction
 
 // Image Debug Flags
-#define IMAGE_LOADING_DEBUG		1 // Show loaded image (original)
-#define IMAGE_SMART_ADD_DEBUG	1 // Shows the masks of images 
+#define IMAGE_LOADING_DEBUG		0 // Show loaded image (original), reloads every image with LAZY_IMAGE_PIXELS
+#define IMAGE_SMART_ADD_DEBUG	1 // Shows the summed blend weights of the composite
 #define IMAGE_MATCHING_DEBUG	1 //tranfomation matrixes, etc - nice
 #define IMAGE_MATCHING_DISPLAY  0 //Shows matched points
 #define IMAGE_COMPOSITE_DEBUG	1 // Shows each step of the composition of the final image
 
+// Benchmark Flags
+#define HAMMING_MATCHER_BENCHMARK	0 // Time matchHamming against OpenCV's BFMatcher on the WLH images, then exit
+
+// Tracing Flags
+#define TRACE_PIPELINE			0 // Record a span for every stage, image and pair, and write them out as a Chrome trace (chrome://tracing or Perfetto)
+#define TRACE_OUTPUT_FILE		"autostitch-trace.json"
+
 // Console Printing Flags
 #define PRINT_CONSOLE_DEBUG		1 // Printing general info in console - leave on to see where program is
+#define PRINT_MEMORY_USAGE		1 // Printing the peak resident memory of the run at the end
 #define PRINT_CAMERA_DEBUG		1 // Printing camera matrix information
 #define PRINT_PADDING_DEBUG		1 // Printing padding procedure information
 #define PRINT_MATCHES_DEBUG		1 // Printing match scores 
 
 // File Settings
 #define SAVE_MATCH_SCORES		1
+#define USE_MATCH_CACHE			1 // Reuse features, matches and homographies from earlier runs on unchanged images
+#define MATCH_CACHE_SUFFIX		".autostitch-cache" // Cache lives next to the image folder, as <folder><suffix>
 #define SAVE_COMPOSITE			1
 #define FOLDER					2
-#define MAX_IMAGES_TO_LOAD		4 // We should add something for all? Idk how though 
+#define MAX_IMAGES_TO_LOAD		4 // Images to load from the folder, 0 loads all of them
 
 /* ------------------------------ Global Variables ------------------------------ */
 
@@ -60,540 +153,2571 @@ using namespace cv;
 4- Nat's dirty room (Room)
 */
 
-string folderPath; // Global for folder path
-vector<int> imagesInComposite; // Indices of the images in the composite
-double imageMatchingThreshold;
+struct StitchJob;
+extern thread_local StitchJob* job; // Job whose state the calling thread works on, see StitchJob
 
 /* ------------------------------ Global Data Structures ------------------------------ */
 
 struct PathNode {
-	int path[2]; // Point A to Point B :) 
+	int path[2]; // Point A to Point B :) -> path[0] is the parent already in the composite, path[1] the image added
 };
 
 typedef struct PathNode PathNode;
 typedef vector<PathNode> Path;
 
-Path compositeImagePath; // Nice
+struct PairMatch {
+	int img1indx, img2indx; // The pair, img1indx < img2indx
+	vector<DMatch> goodMatches; // Filtered matches from img1 (query) to img2 (train)
+	double matchScore = 0;
+	Mat homo1; // Maps img2 onto img1, empty if the pair wasn't verified
+	bool cached = false; // Loaded from the match cache, homography included
+	double matchMicros = 0; // Time FindMatches spent on the pair
+	double solveMicros = 0; // Time solveTransforms spent on the pair
+	int ransacPoints = 0, ransacInliers = 0; // Matches given to the homography solver and how many it kept
+	int ransacIterations = 0; // Samples the solver drew before it was confident
+}; // Result of matching one pair, filled by a worker and added to the match graph afterwards
+
+struct StreamSource {
+	VideoCapture video; // Open when streaming from a video file
+	string folder; // Watched for new images otherwise
+	string lastFile; // Newest file taken so far
+	string pendingFile; // Newest file seen still being written, and its size at the last poll
+	uintmax_t pendingSize = 0;
+}; // Where streaming mode's frames come from, and how far it has got
+
+// Intrinsics of the same camera for an image resized by (sx, sy)
+Mat scaleIntrinsic(const Mat& intrinsic, double sx, double sy) {
+	Mat scale = (Mat_<double>(3, 3) << sx, 0, 0, 0, sy, 0, 0, 0, 1);
+	return scale * intrinsic;
+}
+
+struct CameraModel {
+	Mat intrinsic = (Mat_<double>(3, 3) << 600, 0, 0, 0, 600, 0, 0, 0, 1); // Principal point of 0 means the image center
+	Mat distortion = (Mat_<double>(1, 5) << 0.2, 0.05, 0.00, 0, 0); // k1 k2 p1 p2 k3
+	Size calibrationSize; // Image size the intrinsics were calibrated at, empty if they hold for any loaded size
+
+	// Intrinsics for an image of the given size taken with this camera, levelScale times the matching scale
+	Mat intrinsicFor(Size size, double levelScale = 1) const {
+		//the built in model is in pixels at the matching scale
+		Mat scaled = scaleIntrinsic(intrinsic, levelScale, levelScale);
+		if (!calibrationSize.empty()) {
+			scaled = scaleIntrinsic(intrinsic, double(size.width) / calibrationSize.width, double(size.height) / calibrationSize.height);
+		}
+		if (scaled.at<double>(0, 2) == 0 && scaled.at<double>(1, 2) == 0) {
+			scaled.at<double>(0, 2) = size.width / 2;
+			scaled.at<double>(1, 2) = size.height / 2;
+		}
+		return scaled;
+	}
+}; // Lens model used by UNDISTORT_ON_LOAD, the built in default until loadCameraModel reads a calibration
+
+CameraModel cameraModel;
+
+struct UndistortMap {
+	Mat map1, map2; // Fixed-point remap tables from initUndistortRectifyMap (CV_16SC2 + CV_16UC1)
+	Mat coverage; // Output pixels that land inside the source image
+}; // Undistortion for one (source size, output size), shared by every frame of that size
 
 /* ------------------------------ Function Protocols ------------------------------ */
 
 // File management 
-void setFolderPath();
-bool importImages(string folderPath);
+void setFolderPath(int folder = FOLDER);
+bool importImages(string folderPath, function<void(int)> onLoaded = nullptr);
+bool isImageFile(const filesystem::path& path);
+Mat decodeReducedImage(const vector<uchar>& bytes, double scale, double& remaining);
+vector<uchar> readFileBytes(string path);
+size_t peakResidentBytes();
+bool loadCameraModel(string filename);
 bool saveResult(Mat& src, string filename);
-bool saveMatches(string filename);
+bool saveMatches(string filename, const vector<PairMatch>& pairMatches);
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL);
+uint64_t featureParameterHash();
+uint64_t matchParameterHash();
+uint64_t imageCacheKey(const vector<uchar>& bytes);
 
 // Preprocessing :) 
-Mat addImagePadding(Mat& img);
+struct UndistortMap;
+const UndistortMap& undistortMap(Size source, Size output, double levelScale);
+Rect contentBounds(const Mat& img);
+Mat addImagePadding(Mat& img, Mat& mask, Point& offset);
+void ensurePixels(int imgindx);
+void computeFeatherWeights(const Mat& coverage, Mat& weights, double width);
 Mat translateImg(Mat& img, Mat& target, int offsetx, int offsety);
 
-// Step 1 - Match finding
-void FindMatches(int img1indx, int img2indx);
+// Step 1 - Feature extraction and match finding
+void computeFeatures(int imgindx);
+void bucketKeypoints(vector<KeyPoint>& keypoints, Rect area);
+vector<PairMatch> selectCandidatePairs();
+Mat buildVocabulary();
+Mat bowSignature(Mat& vocabulary, Mat& descriptors);
+int nearestWord(Mat& vocabulary, const uchar* descriptor);
+int hammingDistance(const uchar* a, const uchar* b, int bytes);
+void matchHamming(const Mat& query, const Mat& train, double ratio, bool crossCheck, vector<DMatch>& matches, vector<DMatch>& goodMatches);
+void benchmarkHammingMatcher(string folderPath);
+PairMatch FindMatches(int img1indx, int img2indx);
+void reportPairMatch(PairMatch& match);
 
 // Step 2 - Transformation estimation
-void solveTransforms(vector<Point2d>& transformPtsImg1, vector<Point2d>& transformPtsImg2, int img1indx, int img2indx);
+void solveTransforms(PairMatch& match);
+Mat prosacHomography(const vector<Point2d>& src, const vector<Point2d>& dst, vector<uchar>& inlierMask, int& iterations);
+int countInliers(const Mat& homo, const vector<Point2d>& src, const vector<Point2d>& dst, vector<uchar>& inlierMask);
+void refineToCompositeScale(int centerimgIndex);
+Mat refineEdgeHomography(int parent, int child, const Mat& lifted, const Mat& parentGrey, const Mat& childGrey);
 
 // Step 3 - Composite Image Generation
 int findCenterImage(); //get the index of the image with the least weights to it 
-Path generateAssemblyPath(); // Generate the optimal assembly path -> This would be cool but could also be hardcoded..
-Mat composite2Images(Mat& composite, int img1indx, int img2indx, bool useImageSpecified, Mat& imageSpecified);
-Mat smartAddImg(Mat& img_1, Mat& img_2);
+Path generateAssemblyPath(int centerimgIndex); // Generate the optimal assembly path -> spanning tree of the best matches
+Rect planCanvas(int centerimgIndex);
+double estimateFocalLength(int centerimgIndex);
+bool imageBounds(int imgindx, Rect& bounds);
+void ensureProjectionMap(int imgindx);
+void composite2Images(Mat& accumulator, vector<mutex>& bandLocks, int imgindx, Point origin, const Mat& weighted = Mat());
+void renderComposite(Rect canvas, Mat& composite, Mat* weightSum = nullptr);
+Mat warpToCanvas(int imgindx, Point origin, Size canvas, Rect& roi, const Mat& weighted = Mat());
+Mat warpImage(int imgindx, Mat& homo, Size canvas, Rect& roi, const Mat& weighted = Mat());
+bool renderTiledComposite(Rect canvas, string folder);
+Mat weightedImage(int imgindx);
+bool projectedBounds(const Mat& homo, Rect source, Rect& bounds);
+Rect warpedBounds(const Mat& homo, Rect source, Size canvas);
+void accumulateImage(Mat& accumulator, const Mat& warped, Rect roi, vector<mutex>* bandLocks = nullptr);
+void normalizeAccumulator(const Mat& accumulator, Mat& composite);
+void blendImages(Mat& composite, const Mat& warped);
+
+// Stitching jobs
+bool stitchFolder();
+bool parseServiceJob(const string& line, StitchJob& parsed, string& error);
+int runService(istream& in);
+
+// Streaming mode
+void stitchStream(string source);
+bool nextStreamFrame(StreamSource& source, Mat& frame, double& remainingScale, string& name);
 
 /* ------------------------------ Global Classes --------------------------------- */
-class subImage {
+#if TRACE_PIPELINE
+thread_local size_t threadAllocatedBytes = 0; // Heap and Mat bytes this thread has allocated so far
+atomic<size_t> processAllocatedBytes{ 0 }; // The same over every thread
+
+inline void countAllocation(size_t bytes) {
+	threadAllocatedBytes += bytes;
+	processAllocatedBytes.fetch_add(bytes, memory_order_relaxed);
+}
+
+struct TraceEvent {
+	const char* name; // Span names are literals
+	long long start, duration; // Microseconds since the log started
+	string args; // JSON members, already formatted
+}; // One finished span
+
+class TraceLog {
 public:
-	string path; // File path
-	string name; // File name
-	Mat img; // Image source
-	Mat imgGrey; // Gray Image
-	vector<vector<DMatch>> goodMatches; // Matrix of all of the matches 
-	vector<double> goodMatchScores; // List of all the goodMatchScores
-	vector<Mat> homographyMatrixes; // List of all the homographies to other mats
+	TraceLog() : origin(steady_clock::now()) {}
 
-	// subImage Constructor
-	subImage(string path) {
-		goodMatches.resize(MAX_IMAGES_TO_LOAD);
-		goodMatchScores.resize(MAX_IMAGES_TO_LOAD);
-		homographyMatrixes.resize(MAX_IMAGES_TO_LOAD);
+	long long now() { return duration_cast<microseconds>(steady_clock::now() - origin).count(); }
 
-		this->path = path;
+	// Spans are kept per thread without locking, the buffers outlive their threads for write
+	void record(TraceEvent event) { local().events.push_back(move(event)); }
+
+	// Label for the calling thread in the trace viewer
+	void nameThread(string name) { local().name = name; }
 
-		//load the image, but center it with a black border half its size
-		Mat distorted = imread(path);
-		Mat temp = Mat(distorted.rows, distorted.cols, distorted.type());
-		//rescale if specified
-		if (RESCALE_ON_LOAD != 1) {
-			resize(distorted, distorted, Size(), RESCALE_ON_LOAD, RESCALE_ON_LOAD);
+	// Puts the calling thread's spans from here on on a new track labelled name, one per service job
+	void startTrack(string name) {
+		slot() = nullptr;
+		local().name = name;
+	}
+
+	// Stages open on any thread, and how many have ever started, so a stage can tell if it overlapped another
+	atomic<int> openStages{ 0 };
+	atomic<long long> stagesStarted{ 0 };
+
+	// Live Mat bytes, with the high-water mark since the last resetMatPeak
+	void addMatBytes(long long bytes) {
+		long long live = liveMatBytes.fetch_add(bytes) + bytes;
+		long long peak = peakMatBytes.load();
+		while (live > peak && !peakMatBytes.compare_exchange_weak(peak, live)) {}
+	}
+	void resetMatPeak() { peakMatBytes = liveMatBytes.load(); }
+	long long matPeak() { return peakMatBytes.load(); }
+
+	// Text as the inside of a JSON string, for names and arguments that come from paths
+	static string escape(const string& text) {
+		string escaped;
+		for (char c : text) {
+			if (c == '"' || c == '\\') {
+				escaped += '\\';
+				escaped += c;
+			}
+			else if ((unsigned char)c < 0x20) {
+				char code[8];
+				snprintf(code, sizeof(code), "\\u%04x", c);
+				escaped += code;
+			}
+			else {
+				escaped += c;
+			}
 		}
+		return escaped;
+	}
 
-		// Undistort the image with the camera matrix -- major key
-		if (UNDISTORT_ON_LOAD) {
-			Mat intrinsic = (Mat_<double>(3, 3) << 600, 0, distorted.cols / 2, 0, 600, distorted.rows / 2, 0, 0, 1); // ... 
-			Mat distortionCoef = (Mat_<double>(1, 5) << 0.2, 0.05, 0.00, 0, 0); // We should make this a global setting
-			Mat camMatrix = getOptimalNewCameraMatrix(intrinsic, distortionCoef, distorted.size(), 0);//make the actual transforma matrix 
-			if (IMAGE_LOADING_DEBUG) {
-				cout << "Camera matrix: \n" << camMatrix << endl;
+	// Chrome trace-event JSON: one complete ("X") event per span, one thread_name record per thread
+	bool write(string filename) {
+		lock_guard<mutex> guard(buffersLock);
+		ofstream out(filename);
+		out << "{\"traceEvents\": [";
+		bool first = true;
+		for (auto& buffer : buffers) {
+			if (!buffer->name.empty()) {
+				out << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->index
+					<< ", \"args\": {\"name\": \"" << escape(buffer->name) << "\"}}";
+				first = false;
+			}
+			for (TraceEvent& event : buffer->events) {
+				out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->index
+					<< ", \"ts\": " << event.start << ", \"dur\": " << event.duration << ", \"args\": {" << event.args << "}}";
+				first = false;
 			}
-			temp = Mat(distorted.rows, distorted.cols, distorted.type());
-			undistort(distorted, temp, camMatrix, distortionCoef);
 		}
-		else {
-			temp = distorted;
+		out << "\n]}\n";
+		if (PRINT_CONSOLE_DEBUG) {
+			cout << "Wrote pipeline trace to " << filename << endl;
 		}
+		return out.good();
+	}
 
-		this->img = addImagePadding(temp);
-		//// center it with a black border PADDING_AMMOUNT its size
-		//this->img = Mat(temp.rows * PADDING_AMMOUNT, temp.cols * PADDING_AMMOUNT, temp.type());
-		//Mat trans_mat = (Mat_<double>(2, 3) << 1, 0, temp.cols / PADDING_OFFSET, 0, 1, temp.rows / PADDING_OFFSET);
-		//warpAffine(temp, this->img, trans_mat, this->img.size());
-
-		cvtColor(this->img, this->imgGrey, COLOR_RGB2GRAY);
+private:
+	struct ThreadBuffer {
+		int index = 0;
+		string name;
+		vector<TraceEvent> events;
+	};
+	steady_clock::time_point origin;
+	mutex buffersLock;
+	vector<shared_ptr<ThreadBuffer>> buffers;
+	atomic<long long> liveMatBytes{ 0 }, peakMatBytes{ 0 };
+
+	static shared_ptr<ThreadBuffer>& slot() {
+		thread_local shared_ptr<ThreadBuffer> buffer;
+		return buffer;
 	}
-}; // Class storing details regarding an image
 
-vector<subImage> imageSet; // Initialize a vector of all of the subImages -> to be combined into the 'super' image
+	ThreadBuffer& local() {
+		shared_ptr<ThreadBuffer>& buffer = slot();
+		if (!buffer) {
+			buffer = make_shared<ThreadBuffer>();
+			lock_guard<mutex> guard(buffersLock);
+			buffer->index = int(buffers.size());
+			buffers.push_back(buffer);
+		}
+		return *buffer;
+	}
+}; // Spans recorded by every thread, written out once at the end of the run
 
-/* --------------------------------- Main Routine ------------------------------------- */
+TraceLog traceLog;
 
-int main(int argc, char* argv[]) {
-	auto start = high_resolution_clock::now();
-	Mat compositeImage;
+class TraceSpan {
+public:
+	// A stage span also reports process-wide allocations, the Mat high-water mark and peak RSS. Those
+	// can't be told apart between stages that overlap, as concurrent service jobs' do, so an overlapped
+	// stage is marked as such and only reports peak RSS.
+	TraceSpan(const char* name, bool stage = false) : name(name), stage(stage) {
+		startAllocated = threadAllocatedBytes;
+		if (stage) {
+			overlapped = traceLog.openStages++ > 0;
+			startStage = ++traceLog.stagesStarted;
+			startProcessAllocated = processAllocatedBytes.load();
+			if (!overlapped) {
+				traceLog.resetMatPeak();
+			}
+		}
+		start = traceLog.now();
+	}
 
-	setFolderPath(); // Set the folder based for testing
-	if (PRINT_CONSOLE_DEBUG) { // Initial steps
-		cout << "\n Program running from directory: " << filesystem::current_path() << endl;
-		cout << "\n Opening " << MAX_IMAGES_TO_LOAD << " images from " << folderPath << " folder \n" << endl;
+	~TraceSpan() {
+		long long end = traceLog.now();
+		arg("allocBytes", threadAllocatedBytes - startAllocated);
+		if (stage) {
+			overlapped = overlapped || traceLog.stagesStarted.load() != startStage;
+			traceLog.openStages--;
+			if (overlapped) {
+				arg("overlapped", 1);
+			}
+			else {
+				arg("processAllocBytes", processAllocatedBytes.load() - startProcessAllocated);
+				arg("peakMatBytes", traceLog.matPeak());
+			}
+			arg("peakRssBytes", peakResidentBytes());
+		}
+		traceLog.record(TraceEvent{ name, start, end - start, move(args) });
 	}
 
-	if (!importImages(folderPath)) {
-		cout << "Problem importing images!" << endl;
-		return -1;
+	template<typename T> void arg(const char* key, T value) {
+		args += string(args.empty() ? "\"" : ", \"") + key + "\": " + to_string(value);
 	}
-	
-	if (IMAGE_LOADING_DEBUG) { // Show the original images
-		for (subImage img : imageSet) {
-			namedWindow(img.path, WINDOW_NORMAL);
-			imshow(img.path, img.img);
-			resizeWindow(img.path, 600, 600);
-		}
+	void arg(const char* key, const string& value) {
+		args += string(args.empty() ? "\"" : ", \"") + key + "\": \"" + TraceLog::escape(value) + "\"";
 	}
 
-	if (STEP1) { // Match Features
-		auto startStep = high_resolution_clock::now();
-		if (PRINT_CONSOLE_DEBUG) { // Initial steps
-			cout << "\n Beginning Step 1 - Feature Matching Process \n" << endl;
-		}
-		// Write modular matching algorithm here -> have it work with the data structure we defined
-		// Method to filter through the match metric score in step 1, find transformations
-		// Currently O(n^2) -> Could look to optimize using more advanced analytics between images? 
-		for (int i = 0; i < imageSet.size(); i++) {
-			for (int j = 0; j < imageSet.size(); j++) {
-				if (j != i) {
-					//if this is 0 we havent checked this pair yet
-					if (imageSet[i].goodMatchScores[j] == 0) {
-						FindMatches(i, j);
+private:
+	const char* name;
+	bool stage;
+	bool overlapped = false;
+	long long start, startStage = 0;
+	size_t startAllocated, startProcessAllocated = 0;
+	string args;
+}; // Times the enclosing scope on the calling thread
 
-					}
-				}
+class CountingMatAllocator : public MatAllocator {
+public:
+	UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, AccessFlag flags, UMatUsageFlags usageFlags) const override {
+		UMatData* u = Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		if (u) {
+			u->currAllocator = this; // so the buffer comes back through deallocate
+			if (u->origdata) {
+				countAllocation(u->size);
+				traceLog.addMatBytes(u->size);
 			}
 		}
-		auto stop = high_resolution_clock::now();
-		auto duration = duration_cast<microseconds>(stop - startStep);
-		cout << "Time taken for Step 1: " << duration.count() << endl; // Report how long it took
+		return u;
 	}
 
-	if (STEP2) { // Get transformations
-		auto startStep = high_resolution_clock::now();
-		if (PRINT_CONSOLE_DEBUG) { // Initial steps
-			cout << "\n Beginning Step 2 - Generating Transformations \n" << endl;
-		}
-		// Some code to find transformations
-		auto stop = high_resolution_clock::now();
-
+	bool allocate(UMatData* u, AccessFlag accessFlags, UMatUsageFlags usageFlags) const override {
+		return Mat::getStdAllocator()->allocate(u, accessFlags, usageFlags);
+	}
 
+	void deallocate(UMatData* u) const override {
+		if (u && u->origdata) {
+			traceLog.addMatBytes(-(long long)u->size);
+		}
+		Mat::getStdAllocator()->deallocate(u);
+	}
+}; // OpenCV's own allocator, with every Mat buffer counted for the trace
 
+CountingMatAllocator countingMatAllocator;
 
-		auto duration = duration_cast<microseconds>(stop - startStep);
-		cout << "Time taken for Step 2: " << duration.count() << endl; // Report how long it took
+// Heap allocations outside OpenCV are counted too
+void* operator new(size_t size) {
+	countAllocation(size);
+	if (void* p = malloc(size ? size : 1)) {
+		return p;
 	}
-	
-	if (STEP3) {
-		auto startStep = high_resolution_clock::now();
-		if (PRINT_CONSOLE_DEBUG) { // Initial steps
-			cout << "\n Beginning Step 3 - Generating composite image \n" << endl;
+	throw bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+#define TRACE_SPAN(name)		TraceSpan traceSpan(name)
+#define TRACE_STAGE(name)		TraceSpan traceSpan(name, true)
+#define TRACE_ARG(key, value)	traceSpan.arg(key, value)
+#define TRACE_THREAD(name)		traceLog.nameThread(name)
+#define TRACE_TRACK(name)		traceLog.startTrack(name)
+#define TRACE_EXPORT(filename)	traceLog.write(filename)
+#define TRACE_INSTALL()			Mat::setDefaultAllocator(&countingMatAllocator)
+#else
+// Tracing compiles to nothing, arguments included. Labels are left unevaluated but still count as uses.
+#define TRACE_SPAN(name)
+#define TRACE_STAGE(name)
+#define TRACE_ARG(key, value)
+#define TRACE_THREAD(name)		(void)sizeof(name)
+#define TRACE_TRACK(name)		(void)sizeof(name)
+#define TRACE_EXPORT(filename)
+#define TRACE_INSTALL()
+#endif
+
+class WorkerPool {
+public:
+	// threadCount <= 0 starts one worker per core
+	WorkerPool(int threadCount) {
+		if (threadCount <= 0) {
+			threadCount = max(1, int(thread::hardware_concurrency()));
 		}
-		// dind center image
-		int centerimgIndex = findCenterImage();
-		cout << "Center img is img indx " << centerimgIndex << endl;
+		queues = vector<WorkQueue>(threadCount);
+		for (int i = 0; i < threadCount; i++) {
+			workers.push_back(thread(&WorkerPool::workerLoop, this, i));
+		}
+	}
+
+	~WorkerPool() {
+		{
+			lock_guard<mutex> guard(stateLock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (thread& worker : workers) {
+			worker.join();
+		}
+	}
 
-		// load midle image 
-		compositeImage = imageSet[centerimgIndex].img; // Set composite to first image for now
-		imagesInComposite.push_back(centerimgIndex);
+	int size() { return int(workers.size()); }
+
+	// Splits rows [0, rows) into blocks of rowsPerTask and runs body(rowStart, rowEnd) on each
+	void parallelForRows(int rows, int rowsPerTask, const function<void(int, int)>& body) {
+		int blocks = (rows + rowsPerTask - 1) / rowsPerTask;
+		parallelFor(blocks, [&](int block) {
+			body(block * rowsPerTask, min(rows, (block + 1) * rowsPerTask));
+		});
+	}
 
+	// Runs task(0) ... task(count - 1) on the workers and blocks until all of them are done.
+	// Each worker starts on its own contiguous block of indices and steals from the back of
+	// another worker's block once it runs dry, so a few expensive tasks don't stall the batch.
+	// A task that calls parallelFor itself runs the inner loop inline on its worker. Tasks see the
+	// caller's job, and batches from several job threads take turns on the same workers.
+	void parallelFor(int count, const function<void(int)>& task) {
+		if (count <= 0) {
+			return;
+		}
+		if (onWorkerThread()) {
+			for (int i = 0; i < count; i++) {
+				task(i);
+			}
+			return;
+		}
+		lock_guard<mutex> batchGuard(batchLock); // one batch at a time
+		failure = nullptr;
+		remaining = count;
+		int workerCount = int(queues.size());
+		for (int w = 0; w < workerCount; w++) {
+			lock_guard<mutex> guard(queues[w].lock);
+			for (int i = count * w / workerCount; i < count * (w + 1) / workerCount; i++) {
+				queues[w].tasks.push_back(Task{ &task, i, job });
+			}
+		}
+		unique_lock<mutex> guard(stateLock);
+		batch++;
+		wake.notify_all();
+		done.wait(guard, [this] { return remaining == 0; });
+		if (failure) {
+			rethrow_exception(failure);
+		}
+	}
 
-		//all images that map to center image below threshold get added to composite
-		for (int i = 0; i < imageSet.size(); i++) {
-			if (i != centerimgIndex) {
-				if (imageSet[i].goodMatchScores[centerimgIndex] < imageMatchingThreshold) {
-					imagesInComposite.push_back(i);
-					compositeImage = composite2Images(compositeImage, centerimgIndex, i,false,compositeImage);
+private:
+	struct Task {
+		const function<void(int)>* run; // each index carries its own batch's function
+		int index;
+		StitchJob* job; // the submitting thread's, so tasks work on its job
+	};
+
+	struct WorkQueue {
+		mutex lock;
+		deque<Task> tasks;
+	};
+
+	vector<thread> workers;
+	vector<WorkQueue> queues;
+	mutex batchLock;
+	mutex stateLock;
+	condition_variable wake;
+	condition_variable done;
+	exception_ptr failure;
+	atomic<int> remaining{ 0 };
+	long long batch = 0;
+	bool stopping = false;
+
+	bool takeTask(int self, Task& task) {
+		for (int i = 0; i < int(queues.size()); i++) {
+			WorkQueue& queue = queues[(self + i) % queues.size()];
+			lock_guard<mutex> guard(queue.lock);
+			if (!queue.tasks.empty()) {
+				if (i == 0) { // own block from the front
+					task = queue.tasks.front();
+					queue.tasks.pop_front();
+				}
+				else { // steal from the back of someone else's
+					task = queue.tasks.back();
+					queue.tasks.pop_back();
 				}
+				return true;
 			}
 		}
-		
-		vector<int> imagesInCompositeLevel2;
-		//for all images that map to an image in the composite but no the center
-		for (int i = 0; i < imageSet.size(); i++) {//check all images 
-			for (int j = 1; j < imagesInComposite.size(); j++) {//with all in composite
-				//dont map to center
-				if (i != centerimgIndex) {
-					//dont map to itself
-					if (i != imagesInComposite[j]) {
-						
-						//make sure this one isnt in the lvl2 composite vector allready 
-						//TODO I had one for lvl 1 composite too but it was causing a infinite loop
-						bool flag = true;
-						/*
-						for (int x = 0; x < imagesInCompositeLevel2.size();x++) {
-							if (i = imagesInCompositeLevel2[x]) {
-								flag = false;
-							}
-						}*/
-						if (flag) {
-							//now if it maps to the one in the composite
-							if (imageSet[imagesInComposite[j]].goodMatchScores[i] < imageMatchingThreshold) {
-								Mat temp = Mat::zeros(compositeImage.rows, compositeImage.cols, compositeImage.type());
-								temp = composite2Images(temp, imagesInComposite[j], i, false, compositeImage);
-								string window = "temp of " + to_string(i) + " to " + to_string(imagesInComposite[j]);
-								namedWindow(window, WINDOW_NORMAL);
-								resizeWindow(window, 600, 600);
-								imshow(window, temp);
-
-
-
-
-								compositeImage = composite2Images(compositeImage, centerimgIndex, imagesInComposite[j], true, temp);
-								imagesInCompositeLevel2.push_back(i);
-								window = "final of " + to_string(imagesInComposite[j]) + " to " + to_string(centerimgIndex);
-								namedWindow(window, WINDOW_NORMAL);
-								resizeWindow(window, 600, 600);
-								imshow(window, compositeImage);
-
-							}
-						}
+		return false;
+	}
 
+	static bool& onWorkerThread() {
+		thread_local bool worker = false;
+		return worker;
+	}
 
+	void workerLoop(int self) {
+		onWorkerThread() = true;
+		TRACE_THREAD("worker " + to_string(self));
+		long long seenBatch = 0;
+		while (true) {
+			{
+				unique_lock<mutex> guard(stateLock);
+				wake.wait(guard, [&] { return stopping || batch != seenBatch; });
+				if (stopping) {
+					return;
+				}
+				seenBatch = batch;
+			}
+			Task task;
+			while (takeTask(self, task)) {
+				try {
+					::job = task.job;
+					(*task.run)(task.index);
+				}
+				catch (...) {
+					lock_guard<mutex> guard(stateLock);
+					if (!failure) {
+						failure = current_exception();
 					}
-
+				}
+				if (remaining.fetch_sub(1) == 1) {
+					lock_guard<mutex> guard(stateLock);
+					done.notify_all();
 				}
 			}
 		}
-		
+	}
+}; // Work-stealing thread pool shared by the pipeline steps
 
+WorkerPool workerPool(WORKER_THREADS);
 
-		
+class MappedFile {
+public:
+	const uchar* data = nullptr;
+	size_t size = 0;
+
+	~MappedFile() { close(); }
 
-		string window = "Final Composite Image of ";
-		for (int i = 0; i < imagesInComposite.size(); i++) {
-			window = window + to_string(imagesInComposite[i]) + ",";
+	// Maps the whole file read-only, false if it doesn't exist or is empty
+	bool open(const string& path) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
 		}
-		window = window + "lv2: ";
-		for (int i = 0; i < imagesInCompositeLevel2.size(); i++) {
-			window = window + to_string(imagesInCompositeLevel2[i]) + ",";
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			close();
+			return false;
 		}
-
-		namedWindow(window, WINDOW_NORMAL);
-		resizeWindow(window, 600, 600);
-		imshow(window, compositeImage);
-		
-		auto stop = high_resolution_clock::now();
-		auto duration = duration_cast<microseconds>(stop - startStep);
-		cout << "Time taken for Step 3: " << duration.count() << endl; // Report how long it took
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			close();
+			return false;
+		}
+		data = (const uchar*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = size_t(fileSize.QuadPart);
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			close();
+			return false;
+		}
+		void* mapped = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		data = mapped == MAP_FAILED ? nullptr : (const uchar*)mapped;
+		size = size_t(info.st_size);
+#endif
+		if (data == nullptr) {
+			close();
+			return false;
+		}
+		return true;
 	}
 
-	if (SAVE_OUTPUT) {
-		saveResult(compositeImage, "CompositeImage.jpg");
+	void close() {
+#ifdef _WIN32
+		if (data != nullptr) UnmapViewOfFile(data);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr) munmap((void*)data, size);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
 	}
 
-	auto stop = high_resolution_clock::now();
-	auto duration = duration_cast<microseconds>(stop - start);
-	cout << "Total time taken: " << duration.count() << endl; // Report how long it took
-
-	waitKey(0);
-}
-
-/* ----------------------------- Function Implementations ------------------------------*/
-
-/* ------------ File Management ----------- */
-
-void setFolderPath() {
-	if (FOLDER == 1) {
-		folderPath = "office2";
-		imageMatchingThreshold = 3600;
-	}
-	else if (FOLDER == 2) {
-		folderPath = "WLH";
-		imageMatchingThreshold = 3000;
-	}
-	else if (FOLDER == 3) {
-		folderPath = "StJames";
-		imageMatchingThreshold = 3300;
-	}
-	else if (FOLDER == 4) {
-		folderPath = "Room";
-		imageMatchingThreshold = 3550;
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+}; // Read-only memory mapping of a whole file
+
+/* Match cache file layout, native little-endian, written by saveMatches:
+	header:	char magic[8] "ASCACHE3", uint32 imageCount, uint32 pairCount
+	images:	uint64 key, uint32 keypointCount, uint32 descriptorBytes,
+			keypointCount x { float x, y, size, angle, response, int32 octave, class_id },
+			keypointCount x descriptorBytes descriptor bytes
+	pairs:	uint64 keyA, keyB, matchParameters, double score, uint32 matchCount, uint32 hasHomography,
+			double homo1[9] (keyB onto keyA), matchCount x { int32 queryIdx, trainIdx, float distance }
+*/
+class MatchCache {
+public:
+	// Maps the cache and indexes its records, records are only decoded when looked up
+	bool open(const string& path) {
+		images.clear();
+		pairs.clear();
+		if (!file.open(path)) {
+			return false;
+		}
+		Reader reader{ file.data, file.data + file.size };
+		char magic[8];
+		uint32_t imageCount = 0, pairCount = 0;
+		if (!reader.read(magic) || memcmp(magic, "ASCACHE3", 8) != 0 || !reader.read(imageCount) || !reader.read(pairCount)) {
+			file.close();
+			return false;
+		}
+		for (uint32_t i = 0; i < imageCount; i++) {
+			const uchar* record = reader.position;
+			uint64_t key;
+			uint32_t keypointCount, descriptorBytes;
+			if (!reader.read(key) || !reader.read(keypointCount) || !reader.read(descriptorBytes)
+				|| !reader.skip(size_t(keypointCount) * (keypointRecordSize + descriptorBytes))) {
+				return corrupt();
+			}
+			images[key] = record;
+		}
+		for (uint32_t p = 0; p < pairCount; p++) {
+			const uchar* record = reader.position;
+			uint64_t keyA, keyB, parameters;
+			double score;
+			uint32_t matchCount, hasHomography;
+			if (!reader.read(keyA) || !reader.read(keyB) || !reader.read(parameters) || !reader.read(score)
+				|| !reader.read(matchCount) || !reader.read(hasHomography)
+				|| !reader.skip(9 * sizeof(double) + size_t(matchCount) * matchRecordSize)) {
+				return corrupt();
+			}
+			if (parameters == matchParameterHash()) {
+				pairs[make_pair(keyA, keyB)] = record;
+			}
+		}
+		return true;
 	}
-	else { cout << "Invalid FOLDER choice"; return; }
-}
 
-bool importImages(string folderPath) {
-	try {
-		int imagesLoaded = 0;
-		for (const auto& entry : std::filesystem::directory_iterator(folderPath)) {
-			if (imagesLoaded < MAX_IMAGES_TO_LOAD) {
-				// cout << entry.path() << std::endl;
-				imageSet.push_back(entry.path().string());//c++ is so weird, i just need to pass in the construtor params and not a new instance 
-				imagesLoaded++;
-			}
-		} return true;
+	void close() {
+		images.clear();
+		pairs.clear();
+		file.close();
 	}
-	catch (const std::exception & e) {
-		//probably couldnt find the folder
-		cout << e.what() << endl;
+
+	bool loadFeatures(uint64_t key, vector<KeyPoint>& keypoints, Mat& descriptors) {
+		auto found = images.find(key);
+		if (found == images.end()) {
 			return false;
+		}
+		Reader reader{ found->second, file.data + file.size };
+		uint32_t keypointCount, descriptorBytes;
+		reader.skip(sizeof(uint64_t));
+		reader.read(keypointCount);
+		reader.read(descriptorBytes);
+		keypoints.resize(keypointCount);
+		for (KeyPoint& keypoint : keypoints) {
+			int32_t octave, classId;
+			reader.read(keypoint.pt.x); reader.read(keypoint.pt.y); reader.read(keypoint.size);
+			reader.read(keypoint.angle); reader.read(keypoint.response);
+			reader.read(octave); reader.read(classId);
+			keypoint.octave = octave;
+			keypoint.class_id = classId;
+		}
+		//copied out so the image doesn't depend on the mapping staying open
+		descriptors = Mat(int(keypointCount), int(descriptorBytes), CV_8U);
+		if (keypointCount > 0) {
+			memcpy(descriptors.data, reader.position, size_t(keypointCount) * descriptorBytes);
+		}
+		return true;
 	}
-}
 
-bool saveResult(Mat& src, string filename) {
-	try {
-		imwrite(filename, src);
+	// Fills match for (keyA, keyB); a record stored the other way round is flipped
+	bool loadPair(uint64_t keyA, uint64_t keyB, PairMatch& match) {
+		bool flipped = false;
+		auto found = pairs.find(make_pair(keyA, keyB));
+		if (found == pairs.end()) {
+			found = pairs.find(make_pair(keyB, keyA));
+			flipped = true;
+			if (found == pairs.end()) {
+				return false;
+			}
+		}
+		Reader reader{ found->second, file.data + file.size };
+		uint32_t matchCount, hasHomography;
+		reader.skip(3 * sizeof(uint64_t));
+		reader.read(match.matchScore);
+		reader.read(matchCount);
+		reader.read(hasHomography);
+		Mat homo1(3, 3, CV_64F);
+		memcpy(homo1.data, reader.position, 9 * sizeof(double));
+		reader.skip(9 * sizeof(double));
+		match.homo1 = hasHomography ? (flipped ? Mat(homo1.inv()) : homo1) : Mat();
+		match.goodMatches.resize(matchCount);
+		for (DMatch& goodMatch : match.goodMatches) {
+			int32_t queryIdx, trainIdx;
+			reader.read(queryIdx);
+			reader.read(trainIdx);
+			reader.read(goodMatch.distance);
+			goodMatch.queryIdx = flipped ? trainIdx : queryIdx;
+			goodMatch.trainIdx = flipped ? queryIdx : trainIdx;
+			goodMatch.imgIdx = 0;
+		}
 		return true;
 	}
-	catch (Exception & e) {
-		cout << e.what() << endl;
-		return false;
-	}
-}
-
-bool saveMatches(string filename) {
-	return true;
-}
 
+	static const size_t keypointRecordSize = 5 * sizeof(float) + 2 * sizeof(int32_t);
+	static const size_t matchRecordSize = 2 * sizeof(int32_t) + sizeof(float);
 
-/* ------------- Preprocessing ------------ */
+private:
+	struct Reader {
+		const uchar* position;
+		const uchar* end;
 
-Mat translateImg(Mat& img, Mat& target, int offsetx, int offsety) {
-	Mat trans_mat = (Mat_<double>(2, 3) << 1, 0, offsetx, 0, 1, offsety);
-	warpAffine(img, target, trans_mat, img.size());
-	return img;
-}
+		template<typename T> bool read(T& value) {
+			if (size_t(end - position) < sizeof(T)) {
+				return false;
+			}
+			memcpy(&value, position, sizeof(T));
+			position += sizeof(T);
+			return true;
+		}
 
-Mat addImagePadding(Mat& img) {
-	int currentPaddingTop = 0;
-	int currentPaddingLeft = 0;
-	int currentPaddingBottom = 0;
-	int currentPaddingRight = 0;
+		bool skip(size_t bytes) {
+			if (size_t(end - position) < bytes) {
+				return false;
+			}
+			position += bytes;
+			return true;
+		}
+	};
 
-	//so aparently the only good way to break out of nested loops in c++ is goto, go figure
+	MappedFile file;
+	unordered_map<uint64_t, const uchar*> images;
+	map<pair<uint64_t, uint64_t>, const uchar*> pairs;
 
+	bool corrupt(); // logs through the job, so it is defined once StitchJob is
+}; // Memory-mapped store of per-image features and per-pair match results from earlier runs
 
-	//start from top 
-	for (int r = 0; r < img.rows; r++) {
-		for (int c = 0; c < img.cols; c++) {
-			if (img.at<Vec3b>(r, c) != Vec3b(0, 0, 0)) {
-				currentPaddingTop = r;
-				goto leftCheck;
+class MatchGraph {
+public:
+	struct KeypointPair {
+		int32_t query, train; // keypoint indices in the edge's img1 and img2
+	};
+
+	struct Edge {
+		int img1indx, img2indx; // img1indx < img2indx
+		double score;
+		Matx33d homography; // Maps img2 onto img1, the other direction is its inverse
+		int matchBegin, matchCount; // slice of the packed keypoint pairs
+	};
+
+	struct Neighbour {
+		int image;
+		int edge;
+	};
+
+	// Rebuilds the graph from a round of pair matching. Only pairs that got a homography become edges,
+	// each stored once and reachable from both of its images
+	void build(int imageCount, const vector<PairMatch>& pairMatches) {
+		edges.clear();
+		keypointPairs.clear();
+		offsets.assign(imageCount + 1, 0);
+		for (const PairMatch& match : pairMatches) {
+			if (match.homo1.empty()) {
+				continue;
 			}
-		}
-	}
-leftCheck:
-	//start from left 
-	for (int c = 0; c < img.cols; c++) {
-		for (int r = 0; r < img.rows; r++) {
-			if (img.at<Vec3b>(r, c) != Vec3b(0, 0, 0)) {
-				currentPaddingLeft = c;
-				goto bottomCheck;
+			Edge edge;
+			edge.img1indx = match.img1indx;
+			edge.img2indx = match.img2indx;
+			edge.score = match.matchScore;
+			Mat homo;
+			match.homo1.convertTo(homo, CV_64F);
+			edge.homography = Matx33d((const double*)homo.data);
+			edge.matchBegin = int(keypointPairs.size());
+			edge.matchCount = int(match.goodMatches.size());
+			for (const DMatch& goodMatch : match.goodMatches) {
+				keypointPairs.push_back(KeypointPair{ goodMatch.queryIdx, goodMatch.trainIdx });
 			}
+			edges.push_back(edge);
+			offsets[edge.img1indx + 1]++;
+			offsets[edge.img2indx + 1]++;
 		}
-	}
-bottomCheck:
-	//start from bottom
-	for (int r = img.rows - 1; r >= 0; r--) {
-		for (int c = 0; c < img.cols; c++) {
-			if (img.at<Vec3b>(r, c) != Vec3b(0, 0, 0)) {
-				currentPaddingBottom = img.rows - r - 1;
-				goto rightCheck;
-			}
+		//compressed rows: image i's neighbours are adjacency[offsets[i], offsets[i + 1]), sorted by image
+		for (int i = 0; i < imageCount; i++) {
+			offsets[i + 1] += offsets[i];
 		}
-	}
-rightCheck:
-	//start from right
-	for (int c = img.cols - 1; c >= 0; c--) {
-		for (int r = 0; r < img.rows; r++) {
-			if (img.at<Vec3b>(r, c) != Vec3b(0, 0, 0)) {
-				currentPaddingRight = img.cols - c - 1;
-				goto endOfChecks;
-			}
+		adjacency.assign(offsets[imageCount], Neighbour{ 0, 0 });
+		vector<int> filled(offsets.begin(), offsets.end() - 1);
+		for (int e = 0; e < edges.size(); e++) {
+			adjacency[filled[edges[e].img1indx]++] = Neighbour{ edges[e].img2indx, e };
+			adjacency[filled[edges[e].img2indx]++] = Neighbour{ edges[e].img1indx, e };
+		}
+		for (int i = 0; i < imageCount; i++) {
+			sort(adjacency.begin() + offsets[i], adjacency.begin() + offsets[i + 1],
+				[](const Neighbour& a, const Neighbour& b) { return a.image < b.image; });
 		}
 	}
-endOfChecks:
-
-
-	cout << "Image is " << img.rows << " rows by " << img.cols << " cols" << endl;
-	cout << "Top padding: " << currentPaddingTop << " Left padding: " << currentPaddingLeft << " Bottom padding: " << currentPaddingBottom << " Right padding: " << currentPaddingRight << endl;
 
-
-	int paddingNeededTop = 0;
-	int paddingNeededLeft = 0;
-	int paddingNeededBottom = 0;
-	int paddingNeededRight = 0;
-	if (currentPaddingTop < PIXEL_PADDING) {
-		paddingNeededTop = PIXEL_PADDING - currentPaddingTop;
-	}
-	if (currentPaddingLeft < PIXEL_PADDING) {
-		paddingNeededLeft = PIXEL_PADDING - currentPaddingLeft;
+	int imageCount() const { return int(offsets.size()) - 1; }
+	int edgeCount() const { return int(edges.size()); }
+	int degree(int img) const { return offsets[img + 1] - offsets[img]; }
+	const Neighbour* neighboursBegin(int img) const { return adjacency.data() + offsets[img]; }
+	const Neighbour* neighboursEnd(int img) const { return adjacency.data() + offsets[img + 1]; }
+	const Edge& edge(int e) const { return edges[e]; }
+	const KeypointPair* edgeMatches(int e) const { return keypointPairs.data() + edges[e].matchBegin; }
+
+	// Edge between a and b, -1 if the pair wasn't verified
+	int findEdge(int a, int b) const {
+		const Neighbour* begin = neighboursBegin(a);
+		const Neighbour* end = neighboursEnd(a);
+		const Neighbour* found = lower_bound(begin, end, b, [](const Neighbour& n, int image) { return n.image < image; });
+		return (found != end && found->image == b) ? found->edge : -1;
 	}
-	if (currentPaddingBottom < PIXEL_PADDING) {
-		paddingNeededBottom = PIXEL_PADDING - currentPaddingBottom;
-	}
-	if (currentPaddingRight < PIXEL_PADDING) {
-		paddingNeededRight = PIXEL_PADDING - currentPaddingRight;
+
+	// Match score of a and b, UNMATCHED_MATCH_SCORE if they aren't connected
+	double score(int a, int b) const {
+		int e = findEdge(a, b);
+		return e < 0 ? UNMATCHED_MATCH_SCORE : edges[e].score;
 	}
-	int offsetx = paddingNeededLeft;
-	int offsety = paddingNeededTop;
 
-	Mat newImage = Mat::zeros(img.rows + paddingNeededTop + paddingNeededBottom, img.cols + paddingNeededLeft + paddingNeededRight, CV_8U);
+	// Homography mapping b onto a, empty if they aren't connected
+	Mat homography(int a, int b) const {
+		int e = findEdge(a, b);
+		if (e < 0) {
+			return Mat();
+		}
+		Mat homo(edges[e].homography);
+		return edges[e].img1indx == a ? homo : Mat(homo.inv());
+	}
 
-	Mat trans_mat = (Mat_<double>(2, 3) << 1, 0, offsetx, 0, 1, offsety);
-	warpAffine(img, newImage, trans_mat, newImage.size());
-	cout << "new image dimensions " << newImage.rows << " rows by " << newImage.cols << " cols" << endl;
-	return newImage;
+	size_t memoryBytes() const {
+		return offsets.capacity() * sizeof(int) + adjacency.capacity() * sizeof(Neighbour)
+			+ edges.capacity() * sizeof(Edge) + keypointPairs.capacity() * sizeof(KeypointPair);
+	}
 
-}
+private:
+	vector<int> offsets;
+	vector<Neighbour> adjacency;
+	vector<Edge> edges;
+	vector<KeypointPair> keypointPairs;
+}; // Verified image pairs as a compressed sparse row graph, memory grows with the edges rather than images squared
 
+class ScratchPool {
+public:
+	struct Stats {
+		size_t requests = 0; // Buffers handed out
+		size_t allocations = 0; // Requests no free block was big enough for
+		size_t allocatedBytes = 0; // Bytes those allocations took
+		size_t heldBytes = 0; // Bytes the pool holds now
+	};
+
+	// A rows x cols buffer of type, zeroed if asked. It is a view of a block the pool keeps, and the block is
+	// free again as soon as every Mat sharing it is gone. The smallest free block of the type that is big
+	// enough is reused; if none is, a free block that is too small is grown, so the pool ends up with one
+	// block per buffer in use at once rather than one per size ever asked for. Blocks come from OpenCV's
+	// allocator, so they are aligned for its SIMD kernels. A buffer too big for a single row block (over
+	// INT_MAX elements) gets a Mat of its own outside the pool. Safe to call from worker threads.
+	Mat acquire(int rows, int cols, int type, bool zeroed = false) {
+		if (rows <= 0 || cols <= 0) {
+			return Mat();
+		}
+		size_t elements = size_t(rows) * size_t(cols);
+		Mat buffer;
+		{
+			lock_guard<mutex> guard(lock);
+			counters.requests++;
+			if (elements > size_t(INT_MAX)) {
+				counters.allocations++;
+				counters.allocatedBytes += elements * CV_ELEM_SIZE(type);
+				return zeroed ? Mat(rows, cols, type, Scalar::all(0)) : Mat(rows, cols, type);
+			}
+			Mat* best = nullptr;
+			Mat* smaller = nullptr;
+			for (Mat& block : blocks) {
+				//the pool's own reference is the only one left once callers are done with a block. Callers drop
+				//theirs on other threads, so the count is read atomically the way OpenCV updates it
+				if (block.type() != type || CV_XADD(&block.u->refcount, 0) > 1) {
+					continue;
+				}
+				if (size_t(block.cols) >= elements) {
+					if (!best || block.cols < best->cols) {
+						best = &block;
+					}
+				}
+				else {
+					smaller = &block;
+				}
+			}
+			if (!best) {
+				if (!smaller) {
+					blocks.push_back(Mat());
+					smaller = &blocks.back();
+				}
+				counters.heldBytes -= smaller->total() * smaller->elemSize();
+				*smaller = Mat(1, int(elements), type);
+				counters.allocations++;
+				counters.allocatedBytes += smaller->total() * smaller->elemSize();
+				counters.heldBytes += smaller->total() * smaller->elemSize();
+				best = smaller;
+			}
+			buffer = best->colRange(0, int(elements)).reshape(0, rows);
+		}
+		if (zeroed) {
+			buffer.setTo(Scalar::all(0));
+		}
+		return buffer;
+	}
 
-/* --------------- Step 1 ----------------- */
+	Stats stats() {
+		lock_guard<mutex> guard(lock);
+		return counters;
+	}
 
-void FindMatches(int img1indx, int img2indx) {
-	Mat& img_1 = imageSet[img1indx].img;
-	Mat& img_2 = imageSet[img2indx].img;
-	
-	double matchScore = 0;
-	//intitate orb detector 
-	vector<KeyPoint> keypoints_1, keypoints_2;
-	Mat descriptors_1, descriptors_2;
-	//Ptr<SIFT> detector = cv::xfeatures2d::SIFT::create;
-	//Ptr<FeatureDetector> detector = ORB::create();
-	Ptr<FeatureDetector> detector = ORB::create(ORB_POINT_COUNT, 1.2, 8, 127, 0, 2, ORB::HARRIS_SCORE, 127, 20);
-	Ptr<DescriptorExtractor> descriptor = ORB::create();
-	Ptr<DescriptorMatcher> matcher = DescriptorMatcher::create("BruteForce-Hamming");
+private:
+	mutex lock;
+	vector<Mat> blocks; // single rows of their type, as long as the biggest buffer they served
+	Stats counters;
+}; // Reusable image-sized buffers for a stitching run, or a run after run, so warping and compositing stop allocating once warm
+
+class subImage;
+
+struct StitchJob {
+	// What to stitch, from setFolderPath or a service job line
+	string folderPath;
+	double imageMatchingThreshold = 0;
+	double loadScale = RESCALE_ON_LOAD; // Scale images are matched at
+	double compositeScale = COMPOSITE_SCALE; // Scale the composite is rendered at, refinement only runs if it isn't loadScale
+	int imagesToLoad = MAX_IMAGES_TO_LOAD; // Images importImages takes from the folder, 0 for all of them
+	string output = TILED_OUTPUT ? TILE_OUTPUT_FOLDER : "CompositeImage.jpg"; // Composite file, or the tile folder with TILED_OUTPUT
+	bool headless = false; // Never touches HighGUI, for service jobs
+
+	// Everything a run builds up
+	double pixelScale = RESCALE_ON_LOAD; // Scale subImage pixels are built at, compositeScale once Step 3 is rendering
+	vector<subImage> imageSet; // Initialize a vector of all of the subImages -> to be combined into the 'super' image
+	MatchGraph matchGraph;
+	Path compositeImagePath; // Nice
+	vector<int> imagesInComposite; // Indices of the images in the composite
+	double projectionFocal = 0; // Radius of the cylinder or sphere in composite pixels, set by planCanvas
+	Point2d projectionCenter; // Center image point on the projection's axis, the origin of the curved canvas
+	Mat compositeImage;
+	ostream log{ cout.rdbuf() }; // Where the pipeline's progress goes, the console unless the job redirects it
+	shared_ptr<ScratchPool> scratch = make_shared<ScratchPool>(); // Warp, blend and tile buffers, kept for the rest of the run or across runs sharing it
+}; // Settings and state of one stitching run. Several can be in flight at once, each on its own thread, and
+   // the worker pool carries the submitting thread's job over to the tasks it runs for it
 
-	//detect points and compute descriptors
-	detector->detect(img_1, keypoints_1);
-	detector->detect(img_2, keypoints_2);
-	descriptor->compute(img_1, keypoints_1, descriptors_1);
-	descriptor->compute(img_2, keypoints_2, descriptors_2);
+class ImageLoader {
+public:
+	struct LoadedImage {
+		int index = -1; // into the paths the loader was given
+		Mat decoded; // empty if the file couldn't be read or decoded
+		double remainingScale = 1; // RESCALE_ON_LOAD still to apply after the reduced decode
+		uint64_t cacheKey = 0;
+	};
+
+	// Starts decoding paths at scale in the background for the calling thread's job, at most capacity images
+	// are decoded ahead of next()
+	ImageLoader(const vector<string>& paths, double scale, int threadCount, int capacity) : paths(paths), scale(scale), capacity(max(1, capacity)), owner(job) {
+		if (threadCount <= 0) {
+			threadCount = max(1, int(thread::hardware_concurrency()) / 2);
+		}
+		threadCount = min(threadCount, max(1, int(paths.size())));
+		for (int i = 0; i < threadCount; i++) {
+			decoders.push_back(thread(&ImageLoader::decodeLoop, this));
+		}
+	}
 
-	//draw keypoints
-	//Mat outimg1;
-	//drawKeypoints(img_1, keypoints_1, outimg1, Scalar::all(-1), DrawMatchesFlags::DEFAULT);
+	~ImageLoader() {
+		{
+			lock_guard<mutex> guard(stateLock);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (thread& decoder : decoders) {
+			decoder.join();
+		}
+	}
 
-	vector<DMatch> matches;
-	//BFMatcher matcher ( NORM_HAMMING );
-	matcher->match(descriptors_1, descriptors_2, matches);
-	double min_dist = 10000, max_dist = 0;
+	// Blocks until another image is decoded, in whatever order they finish. False once every path was handed out
+	bool next(LoadedImage& image) {
+		unique_lock<mutex> guard(stateLock);
+		changed.wait(guard, [this] { return !ready.empty() || taken == paths.size(); });
+		if (ready.empty()) {
+			return false;
+		}
+		image = move(ready.front());
+		ready.pop_front();
+		taken++;
+		guard.unlock();
+		changed.notify_all(); // frees a slot for the decoders, or tells other callers we're done
+		return true;
+	}
 
+private:
+	vector<string> paths;
+	double scale;
+	size_t capacity;
+	StitchJob* owner; // whose settings the cache keys are hashed with
+	vector<thread> decoders;
+	mutex stateLock;
+	condition_variable changed;
+	deque<LoadedImage> ready;
+	size_t claimed = 0; // paths a decoder has started on
+	size_t decoding = 0; // claimed but not in ready yet
+	size_t taken = 0;
+	bool stopping = false;
+
+	void decodeLoop() {
+		TRACE_THREAD("image decoder");
+		job = owner;
+		while (true) {
+			LoadedImage image;
+			{
+				unique_lock<mutex> guard(stateLock);
+				changed.wait(guard, [this] { return stopping || claimed == paths.size() || ready.size() + decoding < capacity; });
+				if (stopping || claimed == paths.size()) {
+					return;
+				}
+				image.index = int(claimed++);
+				decoding++;
+			}
+			try {
+				TRACE_SPAN("decode");
+				//the file is read once, both the cache key and the decoder work from the same bytes
+				vector<uchar> bytes = readFileBytes(paths[image.index]);
+				image.cacheKey = imageCacheKey(bytes);
+				image.decoded = decodeReducedImage(bytes, scale, image.remainingScale);
+				TRACE_ARG("img", image.index);
+				TRACE_ARG("fileBytes", bytes.size());
+				TRACE_ARG("width", image.decoded.cols);
+				TRACE_ARG("height", image.decoded.rows);
+			}
+			catch (const std::exception&) {
+				image.decoded = Mat(); // reported by whoever takes it
+			}
+			{
+				lock_guard<mutex> guard(stateLock);
+				decoding--;
+				ready.push_back(move(image));
+			}
+			changed.notify_all();
+		}
+	}
+}; // Decodes image files on its own threads into a bounded queue
 
-	//Find the minimum and maximum distances between mathces, so the most similar and the least similar 
-	for (int i = 0; i < descriptors_1.rows; i++)
-	{
-		double dist = matches[i].distance;
-		if (dist < min_dist) min_dist = dist;
-		if (dist > max_dist) max_dist = dist;
-		matchScore += (1 + dist) * (1 + dist);
+class subImage {
+public:
+	string path; // File path
+	string name; // File name
+	Mat img; // Image source, empty while LAZY_IMAGE_PIXELS has it released (see ensurePixels)
+	Mat weights; // Feather weight per pixel (CV_8U), 0 where the image has no data, released with img
+	Rect contentRect; // Part of the padded img that holds source pixels
+	Point paddingOffset; // Where the unpadded image starts in img, (0, 0) at the composite scale which isn't padded
+	Mat levelTransform; // Maps composite scale pixels onto the padded matching scale pixels the features are in
+	uint64_t cacheKey = 0; // Content hash + preprocessing settings, identifies the image in the match cache
+	vector<KeyPoint> keypoints; // ORB keypoints, computed once in Step 1
+	Mat descriptors; // ORB descriptors for the keypoints
+	Mat referenceTransform; // Maps this image into the center image, set by generateAssemblyPath
+	Rect projectedRect; // Where the image lands on a curved canvas, set by planCanvas
+	Mat projectionMap1, projectionMap2; // Fixed-point remap tables from projectedRect onto img (see ensureProjectionMap)
+
+	// subImage Constructor
+	subImage() {}
+
+	// distorted is the decoded file, still to be scaled by remainingScale (see decodeReducedImage)
+	subImage(string path, Mat distorted, double remainingScale) {
+		this->path = path;
+		buildPixels(distorted, remainingScale);
+	}
+
+	// Decodes the file again, giving the same pixels the constructor built. Use ensurePixels from worker threads
+	void reloadPixels() {
+		double remainingScale;
+		Mat distorted = decodeReducedImage(readFileBytes(path), job->pixelScale, remainingScale);
+		if (distorted.empty()) {
+			throw runtime_error("Could not decode " + path);
+		}
+		buildPixels(distorted, remainingScale);
+	}
+
+	// Keeps features, metadata and transforms, only the pixels and the projection tables go
+	void releasePixels() {
+		img.release();
+		weights.release();
+		projectionMap1.release();
+		projectionMap2.release();
+	}
+
+	// Rescales, undistorts and pads the decoded file into img and weights
+	void buildPixels(Mat distorted, double remainingScale) {
+		Mat temp;
+		Mat coverage;
+		Size scaledSize(cvRound(distorted.cols * remainingScale), cvRound(distorted.rows * remainingScale));
+		//rescale if specified, left to the undistortion remap when they're fused
+		if (scaledSize != distorted.size() && !(UNDISTORT_ON_LOAD && FUSE_UNDISTORT_RESCALE)) {
+			resize(distorted, distorted, scaledSize);
+		}
+
+		// Undistort the image with the camera matrix -- major key
+		if (UNDISTORT_ON_LOAD) {
+			//one table per size is shared by every frame, each frame is a single remap
+			const UndistortMap& undistortion = undistortMap(distorted.size(), scaledSize, job->pixelScale / job->loadScale);
+			remap(distorted, temp, undistortion.map1, undistortion.map2, INTER_LINEAR, BORDER_CONSTANT);
+			coverage = undistortion.coverage;
+		}
+		else {
+			temp = distorted;
+			//every source pixel has data, black ones included
+			coverage = Mat(distorted.rows, distorted.cols, CV_8U, Scalar(255));
+		}
+
+		//feather weights are computed once here, in the image's own coordinates, and warped with it later.
+		//only the matching level is padded, the composite level is warped straight from the image
+		computeFeatherWeights(coverage, this->weights, FEATHER_WIDTH * job->pixelScale / job->loadScale);
+		if (job->pixelScale == job->loadScale) {
+			this->img = addImagePadding(temp, this->weights, this->paddingOffset);
+			//composite pixel centres onto matching level ones: q + 0.5 = s (p + 0.5), shifted by the padding
+			double s = job->loadScale / job->compositeScale;
+			this->levelTransform = (Mat_<double>(3, 3) << s, 0, paddingOffset.x + 0.5 * (s - 1), 0, s, paddingOffset.y + 0.5 * (s - 1), 0, 0, 1);
+		}
+		else {
+			this->img = temp;
+		}
+		this->contentRect = boundingRect(this->weights);
+		//// center it with a black border PADDING_AMMOUNT its size
+		//this->img = Mat(temp.rows * PADDING_AMMOUNT, temp.cols * PADDING_AMMOUNT, temp.type());
+		//Mat trans_mat = (Mat_<double>(2, 3) << 1, 0, temp.cols / PADDING_OFFSET, 0, 1, temp.rows / PADDING_OFFSET);
+		//warpAffine(temp, this->img, trans_mat, this->img.size());
+	}
+}; // Class storing details regarding an image
+
+StitchJob mainJob; // The run main configures from the settings above
+thread_local StitchJob* job = &mainJob;
+
+/* --------------------------------- Main Routine ------------------------------------- */
+
+#ifndef AUTOSTITCH_NO_MAIN // benchmark.cpp builds this file with its own main
+int main(int argc, char* argv[]) {
+	auto start = high_resolution_clock::now();
+	TRACE_INSTALL();
+	TRACE_THREAD("main");
+
+	if (HAMMING_MATCHER_BENCHMARK) {
+		benchmarkHammingMatcher("WLH");
+		return 0;
+	}
+
+	if (UNDISTORT_ON_LOAD && !loadCameraModel(CAMERA_CALIBRATION_FILE) && PRINT_CAMERA_DEBUG) {
+		cout << "No calibration in " << CAMERA_CALIBRATION_FILE << ", undistorting with the default camera model" << endl;
+	}
+
+	if (argc > 1 && string(argv[1]) == "--service") { // jobs from stdin until it closes, see runService
+		int failed = runService(cin);
+		TRACE_EXPORT(TRACE_OUTPUT_FILE);
+		return failed > 0 ? 1 : 0;
+	}
+
+	setFolderPath(); // Set the folder based for testing
+	if (PRINT_CONSOLE_DEBUG) { // Initial steps
+		cout << "\n Program running from directory: " << filesystem::current_path() << endl;
+		cout << "\n Opening " << job->imagesToLoad << " images from " << job->folderPath << " folder \n" << endl;
+	}
+
+	if (STREAMING_MODE) {
+		stitchStream(string(STREAM_SOURCE).empty() ? job->folderPath : string(STREAM_SOURCE));
+		TRACE_EXPORT(TRACE_OUTPUT_FILE);
+		waitKey(0);
+		return 0;
+	}
+
+	if (!stitchFolder()) {
+		return -1;
+	}
+
+	auto stop = high_resolution_clock::now();
+	auto duration = duration_cast<microseconds>(stop - start);
+	cout << "Total time taken: " << duration.count() << endl; // Report how long it took
+	if (PRINT_MEMORY_USAGE) {
+		cout << "Peak resident memory: " << peakResidentBytes() / (1024 * 1024) << " MB"
+			<< (LAZY_IMAGE_PIXELS ? " (lazy image pixels)" : " (all image pixels resident)") << endl;
+	}
+	TRACE_EXPORT(TRACE_OUTPUT_FILE);
+
+	waitKey(0);
+}
+#endif
+
+/* ----------------------------- Function Implementations ------------------------------*/
+
+/* ------------ Stitching Jobs ----------- */
+
+// Runs Steps 1 to 3 on the calling thread's job and saves the composite to its output. Everything the
+// run builds stays in the job, so several jobs can run at once on their own threads.
+bool stitchFolder() {
+	// Anything computed by an earlier run on the same image content and settings comes from the cache
+	vector<PairMatch> pairMatches;
+	MatchCache cache;
+	string cacheFile = job->folderPath + MATCH_CACHE_SUFFIX;
+	atomic<int> cachedImages{ 0 }, cachedPairs{ 0 };
+	if (STEP1 && USE_MATCH_CACHE) {
+		cache.open(cacheFile);
+	}
+
+	// Detect keypoints and compute descriptors once per image as soon as it is loaded, matching below only reads them
+	auto startLoading = high_resolution_clock::now();
+	bool imported = importImages(job->folderPath, [&](int i) {
+		if (!STEP1) {
+			return;
+		}
+		if (USE_MATCH_CACHE && cache.loadFeatures(job->imageSet[i].cacheKey, job->imageSet[i].keypoints, job->imageSet[i].descriptors)) {
+			cachedImages++;
+		}
+		else {
+			computeFeatures(i);
+		}
+	});
+	if (!imported) {
+		job->log << "Problem importing images!" << endl;
+		return false;
+	}
+	auto stopLoading = high_resolution_clock::now();
+	
+	if (IMAGE_LOADING_DEBUG && !job->headless) { // Show the original images
+		for (int i = 0; i < job->imageSet.size(); i++) {
+			subImage& img = job->imageSet[i];
+			ensurePixels(i);
+			namedWindow(img.path, WINDOW_NORMAL);
+			imshow(img.path, img.img);
+			resizeWindow(img.path, 600, 600);
+			if (LAZY_IMAGE_PIXELS) {
+				img.releasePixels();
+			}
+		}
+	}
+
+	if (STEP1) { // Match Features
+		TRACE_STAGE("Step 1 matching");
+		auto startStep = high_resolution_clock::now();
+		if (PRINT_CONSOLE_DEBUG) { // Initial steps
+			job->log << "\n Beginning Step 1 - Feature Matching Process \n" << endl;
+		}
+		// Pick the pairs worth matching, all of them for small sets and the top-k neighbours otherwise
+		pairMatches = selectCandidatePairs();
+		auto stopSelection = high_resolution_clock::now();
+		if (PRINT_MATCHES_DEBUG) {
+			job->log << "Matching " << pairMatches.size() << " of " << job->imageSet.size() * (job->imageSet.size() - 1) / 2 << " image pairs" << endl;
+		}
+		// Every pair is matched once on the worker pool into its own slot
+		workerPool.parallelFor(int(pairMatches.size()), [&](int p) {
+			PairMatch& match = pairMatches[p];
+			if (USE_MATCH_CACHE && cache.loadPair(job->imageSet[match.img1indx].cacheKey, job->imageSet[match.img2indx].cacheKey, match)) {
+				match.cached = true;
+				cachedPairs++;
+			}
+			else {
+				match = FindMatches(match.img1indx, match.img2indx);
+			}
+		});
+		auto stop = high_resolution_clock::now();
+		auto durationExtraction = duration_cast<microseconds>(stopLoading - startLoading);
+		auto durationSelection = duration_cast<microseconds>(stopSelection - startStep);
+		auto durationMatching = duration_cast<microseconds>(stop - stopSelection);
+		auto duration = duration_cast<microseconds>(stop - startStep);
+		job->log << "Time taken for loading and Step 1 feature extraction: " << durationExtraction.count() << endl;
+		job->log << "Time taken for Step 1 candidate selection: " << durationSelection.count() << endl;
+		job->log << "Time taken for Step 1 matching: " << durationMatching.count() << endl;
+		job->log << "Time taken for Step 1: " << duration.count() << endl; // Report how long it took
+	}
+
+	if (STEP2) { // Get transformations
+		TRACE_STAGE("Step 2 transformations");
+		auto startStep = high_resolution_clock::now();
+		if (PRINT_CONSOLE_DEBUG) { // Initial steps
+			job->log << "\n Beginning Step 2 - Generating Transformations \n" << endl;
+		}
+		// One homography per pair that matched well enough, cached pairs already have theirs
+		workerPool.parallelFor(int(pairMatches.size()), [&](int p) {
+			PairMatch& match = pairMatches[p];
+			if (!match.cached && match.matchScore < job->imageMatchingThreshold + 50) {
+				solveTransforms(match);
+			}
+		});
+		auto stopSolving = high_resolution_clock::now();
+
+		// Results are reported and added to the graph in pair order so they don't depend on the thread count
+		for (PairMatch& match : pairMatches) {
+			if (!job->headless) {
+				reportPairMatch(match);
+			}
+		}
+		job->matchGraph.build(int(job->imageSet.size()), pairMatches);
+		if (PRINT_MATCHES_DEBUG) {
+			//stats over the pairs matched this run, cached pairs weren't timed
+			int matched = 0, solved = 0;
+			long long keypointTotal = 0, iterations = 0;
+			double matchMicros = 0, solveMicros = 0, inlierRatio = 0;
+			for (subImage& image : job->imageSet) {
+				keypointTotal += image.keypoints.size();
+			}
+			for (PairMatch& match : pairMatches) {
+				if (!match.cached) {
+					matched++;
+					matchMicros += match.matchMicros;
+				}
+				if (match.ransacPoints > 0) {
+					solved++;
+					solveMicros += match.solveMicros;
+					iterations += match.ransacIterations;
+					inlierRatio += double(match.ransacInliers) / match.ransacPoints;
+				}
+			}
+			job->log << "Average of " << keypointTotal / max(size_t(1), job->imageSet.size()) << " keypoints per image, "
+				<< matchMicros / max(1, matched) << " us per pair matched" << endl;
+			job->log << "Solved " << solved << " pairs, averaging " << solveMicros / max(1, solved) << " us, "
+				<< double(iterations) / max(1, solved) << " iterations and "
+				<< 100 * inlierRatio / max(1, solved) << "% inliers" << endl;
+			job->log << job->matchGraph.edgeCount() << " verified pairs, match graph uses " << job->matchGraph.memoryBytes() / 1024 << " KB" << endl;
+		}
+		if (USE_MATCH_CACHE) {
+			job->log << "Reused features for " << cachedImages << " of " << job->imageSet.size() << " images and matches for "
+				<< cachedPairs << " of " << pairMatches.size() << " pairs from " << cacheFile << endl;
+			cache.close(); // unmapped before it gets rewritten
+			if (cachedImages < job->imageSet.size() || cachedPairs < pairMatches.size()) {
+				saveMatches(cacheFile, pairMatches);
+			}
+		}
+		auto stop = high_resolution_clock::now();
+		auto durationSolving = duration_cast<microseconds>(stopSolving - startStep);
+		auto duration = duration_cast<microseconds>(stop - startStep);
+		job->log << "Time taken for Step 2 homographies: " << durationSolving.count() << endl;
+		job->log << "Time taken for Step 2: " << duration.count() << endl; // Report how long it took
+	}
+	
+	if (STEP3) {
+		TRACE_STAGE("Step 3 composite");
+		auto startStep = high_resolution_clock::now();
+		if (PRINT_CONSOLE_DEBUG) { // Initial steps
+			job->log << "\n Beginning Step 3 - Generating composite image \n" << endl;
+		}
+		// dind center image
+		int centerimgIndex = findCenterImage();
+		job->log << "Center img is img indx " << centerimgIndex << endl;
+
+		// spanning tree of the best matches from the center, every image gets one transform into the center's frame
+		job->compositeImagePath = generateAssemblyPath(centerimgIndex);
+		if (job->compositeScale != job->loadScale) {
+			// features stay at the matching scale, the transforms and pixels move up to the composite scale
+			auto startRefine = high_resolution_clock::now();
+			refineToCompositeScale(centerimgIndex);
+			auto durationRefine = duration_cast<microseconds>(high_resolution_clock::now() - startRefine);
+			job->log << "Time taken for Step 3 refinement to scale " << job->compositeScale << ": " << durationRefine.count() << endl;
+		}
+		Rect canvas = planCanvas(centerimgIndex);
+
+		if (TILED_OUTPUT) {
+			// the full canvas never exists in memory, tiles are rendered and written out independently
+			if (!renderTiledComposite(canvas, job->output)) {
+				job->log << "Problem writing tiled composite!" << endl;
+				return false;
+			}
+		}
+		else {
+			// images are warped concurrently and summed into an accumulator, which is only normalised at the
+			// end so the result doesn't depend on the order images finish in
+			bool showWeights = IMAGE_SMART_ADD_DEBUG && !job->headless;
+			Mat weightSum;
+			renderComposite(canvas, job->compositeImage, showWeights ? &weightSum : nullptr);
+			if (!job->headless) {
+				if (showWeights) {
+					normalize(weightSum, weightSum, 0, 255, NORM_MINMAX, CV_8U);
+					namedWindow("blendWeights", WINDOW_NORMAL);
+					imshow("blendWeights", weightSum);
+					resizeWindow("blendWeights", 600, 600);
+				}
+
+				string window = "Final Composite Image of ";
+				for (int i = 0; i < job->imagesInComposite.size(); i++) {
+					window = window + to_string(job->imagesInComposite[i]) + ",";
+				}
+
+				namedWindow(window, WINDOW_NORMAL);
+				resizeWindow(window, 600, 600);
+				imshow(window, job->compositeImage);
+			}
+		}
+		
+		auto stop = high_resolution_clock::now();
+		auto duration = duration_cast<microseconds>(stop - startStep);
+		job->log << "Time taken for Step 3: " << duration.count() << endl; // Report how long it took
+		if (PRINT_MEMORY_USAGE) {
+			//once warm, a run over the same images is served entirely from blocks the pool already holds
+			ScratchPool::Stats scratch = job->scratch->stats();
+			job->log << "Scratch buffers: " << scratch.requests << " handed out, " << scratch.allocations << " allocations of "
+				<< scratch.allocatedBytes / (1024 * 1024) << " MB, " << scratch.heldBytes / (1024 * 1024) << " MB held" << endl;
+		}
+	}
+
+	if (SAVE_OUTPUT && !TILED_OUTPUT && !job->compositeImage.empty()) {
+		return saveResult(job->compositeImage, job->output);
+	}
+	return true;
+}
+
+// Reads a job line, "<folder> [scale=<s>] [composite=<s>] [images=<n>] [threshold=<t>] [output=<file>]",
+// into parsed. The composite is rendered at the matching scale unless composite sets another one. False,
+// with the reason in error, if the line has no folder or a setting that can't be read.
+bool parseServiceJob(const string& line, StitchJob& parsed, string& error) {
+	istringstream fields(line);
+	if (!(fields >> parsed.folderPath)) {
+		error = "no folder";
+		return false;
+	}
+	parsed.imageMatchingThreshold = SERVICE_MATCHING_THRESHOLD;
+	parsed.output = filesystem::path(parsed.folderPath).filename().string() + (TILED_OUTPUT ? "-tiles" : "-composite.jpg");
+	parsed.headless = true;
+	bool compositeSet = false;
+	string field;
+	while (fields >> field) {
+		size_t equals = field.find('=');
+		string key = field.substr(0, equals);
+		string value = equals == string::npos ? "" : field.substr(equals + 1);
+		try {
+			if (key == "scale" && stod(value) > 0) {
+				parsed.loadScale = parsed.pixelScale = stod(value);
+			}
+			else if (key == "composite" && stod(value) > 0) {
+				parsed.compositeScale = stod(value);
+				compositeSet = true;
+			}
+			else if (key == "images" && stoi(value) >= 0) {
+				parsed.imagesToLoad = stoi(value);
+			}
+			else if (key == "threshold") {
+				parsed.imageMatchingThreshold = stod(value);
+			}
+			else if (key == "output" && !value.empty()) {
+				parsed.output = value;
+			}
+			else {
+				error = "bad setting " + field;
+				return false;
+			}
+		}
+		catch (logic_error&) { // stod and stoi on something that isn't a number
+			error = "bad setting " + field;
+			return false;
+		}
+	}
+	if (!compositeSet) {
+		parsed.compositeScale = parsed.loadScale;
+	}
+	return true;
+}
+
+// Runs job lines from in until it ends, SERVICE_CONCURRENT_JOBS at a time. Each job has its own StitchJob
+// and runs headless on a job thread, whose scratch pool it takes over from the thread's previous job, while
+// the worker pool, ORB detectors and undistortion maps are shared with every job after it. Jobs on the same folder wait for each other, they would share its match cache.
+// The pipeline's progress goes nowhere, instead every job prints one line, "ok <folder> <images> <ms>
+// <output>" or "failed <folder> <reason>". Returns the number of jobs that failed.
+int runService(istream& in) {
+	mutex inputLock, statusLock, foldersLock;
+	condition_variable folderFreed;
+	set<string> busyFolders;
+	atomic<int> failed{ 0 }, started{ 0 };
+	auto runJobs = [&]() {
+		shared_ptr<ScratchPool> scratch = make_shared<ScratchPool>(); // outlives the jobs, each one starts with the last one's buffers
+		string line;
+		while (true) {
+			{
+				lock_guard<mutex> guard(inputLock);
+				if (!getline(in, line)) {
+					return;
+				}
+			}
+			size_t first = line.find_first_not_of(" \t\r");
+			if (first == string::npos || line[first] == '#') {
+				continue; // blank lines and comments
+			}
+			auto start = high_resolution_clock::now();
+			StitchJob current;
+			current.log.rdbuf(nullptr); // writes fail quietly, on this job's stream only
+			current.scratch = scratch;
+			string error;
+			bool stitched = false;
+			if (parseServiceJob(line, current, error)) {
+				int number = started++;
+				TRACE_TRACK("job " + to_string(number) + " " + current.folderPath); // its stages get a track of their own
+				string folder = filesystem::absolute(current.folderPath).lexically_normal().string();
+				{
+					unique_lock<mutex> guard(foldersLock);
+					folderFreed.wait(guard, [&] { return !busyFolders.count(folder); });
+					busyFolders.insert(folder);
+				}
+				job = &current;
+				try {
+					stitched = stitchFolder();
+					if (!stitched) {
+						error = "couldn't be stitched";
+					}
+				}
+				catch (const std::exception& e) { // cv::Exception, filesystem errors and bad_alloc alike
+					error = e.what();
+				}
+				catch (...) {
+					error = "unknown error";
+				}
+				job = &mainJob;
+				{
+					lock_guard<mutex> guard(foldersLock);
+					busyFolders.erase(folder);
+				}
+				folderFreed.notify_all();
+			}
+			auto duration = duration_cast<milliseconds>(high_resolution_clock::now() - start);
+			lock_guard<mutex> guard(statusLock);
+			if (stitched) {
+				cout << "ok " << current.folderPath << " " << current.imagesInComposite.size() << " "
+					<< duration.count() << " " << current.output << endl;
+			}
+			else {
+				failed++;
+				cout << "failed " << (current.folderPath.empty() ? line : current.folderPath) << " " << error << endl;
+			}
+		}
+	};
+	vector<thread> jobThreads;
+	for (int i = 0; i < SERVICE_CONCURRENT_JOBS; i++) {
+		jobThreads.push_back(thread(runJobs));
+	}
+	for (thread& jobThread : jobThreads) {
+		jobThread.join();
+	}
+	return failed;
+}
+
+/* ------------ File Management ----------- */
+
+bool MatchCache::corrupt() {
+	job->log << "Match cache is corrupt, ignoring it" << endl;
+	close();
+	return false;
+}
+
+void setFolderPath(int folder) {
+	if (folder == 1) {
+		job->folderPath = "office2";
+		job->imageMatchingThreshold = 3600;
+	}
+	else if (folder == 2) {
+		job->folderPath = "WLH";
+		job->imageMatchingThreshold = 3000;
+	}
+	else if (folder == 3) {
+		job->folderPath = "StJames";
+		job->imageMatchingThreshold = 3300;
+	}
+	else if (folder == 4) {
+		job->folderPath = "Room";
+		job->imageMatchingThreshold = 3550;
+	}
+	else { job->log << "Invalid FOLDER choice"; return; }
+}
+
+// Loads the job's first imagesToLoad files of the folder into its imageSet. Files are decoded in the
+// background while the worker pool builds each subImage and runs onLoaded(index) on it, so per-image
+// work starts as soon as the first file is ready instead of after the whole folder is decoded.
+bool importImages(string folderPath, function<void(int)> onLoaded) {
+	TRACE_STAGE("importImages");
+	try {
+		// directory order is up to the filesystem, sort it so runs are repeatable
+		vector<string> paths;
+		for (const auto& entry : std::filesystem::directory_iterator(folderPath)) {
+			if (entry.is_regular_file() && isImageFile(entry.path())) {
+				paths.push_back(entry.path().string());
+			}
+		}
+		sort(paths.begin(), paths.end());
+		if (job->imagesToLoad > 0 && paths.size() > job->imagesToLoad) {
+			paths.resize(job->imagesToLoad);
+		}
+		//filled by index, so the order doesn't depend on which file decodes first
+		job->imageSet.clear();
+		job->imageSet.resize(paths.size());
+
+		ImageLoader loader(paths, job->loadScale, LOADER_THREADS, PREFETCH_QUEUE_SIZE);
+		workerPool.parallelFor(workerPool.size(), [&](int) {
+			ImageLoader::LoadedImage loaded;
+			while (loader.next(loaded)) {
+				if (loaded.decoded.empty()) {
+					throw runtime_error("Could not decode " + paths[loaded.index]);
+				}
+				job->imageSet[loaded.index] = subImage(paths[loaded.index], loaded.decoded, loaded.remainingScale);
+				job->imageSet[loaded.index].cacheKey = loaded.cacheKey;
+				if (onLoaded) {
+					TRACE_SPAN("onLoaded");
+					TRACE_ARG("img", loaded.index);
+					onLoaded(loaded.index);
+				}
+				if (LAZY_IMAGE_PIXELS) {
+					job->imageSet[loaded.index].releasePixels();
+				}
+			}
+		});
+		return true;
+	}
+	catch (const std::exception & e) {
+		//probably couldnt find the folder
+		job->log << e.what() << endl;
+			return false;
+	}
+}
+
+// Whether the file has an image extension, so shortcuts and notes left in a folder aren't loaded
+bool isImageFile(const filesystem::path& path) {
+	string extension = path.extension().string();
+	transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(tolower(c)); });
+	return extension == ".jpg" || extension == ".jpeg" || extension == ".png" || extension == ".bmp"
+		|| extension == ".tif" || extension == ".tiff" || extension == ".webp";
+}
+
+// Decodes at the largest JPEG DCT-domain reduction (1/2, 1/4 or 1/8) that doesn't go below scale, so
+// only the remaining fraction is left for resize. Other formats are decoded at full size by OpenCV first.
+Mat decodeReducedImage(const vector<uchar>& bytes, double scale, double& remaining) {
+	const int reductions[3][2] = { { 8, IMREAD_REDUCED_COLOR_8 }, { 4, IMREAD_REDUCED_COLOR_4 }, { 2, IMREAD_REDUCED_COLOR_2 } };
+	int reduction = 1;
+	int flags = IMREAD_COLOR;
+	for (auto& option : reductions) {
+		if (1.0 / option[0] >= scale) {
+			reduction = option[0];
+			flags = option[1];
+			break;
+		}
+	}
+	remaining = scale * reduction;
+	return imdecode(bytes, flags);
+}
+
+vector<uchar> readFileBytes(string path) {
+	ifstream in(path, ios::binary);
+	vector<uchar> bytes(size_t(filesystem::file_size(path)));
+	in.read((char*)bytes.data(), streamsize(bytes.size()));
+	return bytes;
+}
+
+// High-water mark of the process's resident memory
+size_t peakResidentBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return 0;
+	}
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return size_t(usage.ru_maxrss); // bytes on macOS
+#else
+	return size_t(usage.ru_maxrss) * 1024; // kilobytes on Linux
+#endif
+#endif
+}
+
+// Replaces the built in camera model with a calibration file, false (keeping the default) if it can't be read
+bool loadCameraModel(string filename) {
+	try {
+		FileStorage calibration(filename, FileStorage::READ);
+		if (!calibration.isOpened()) {
+			return false;
+		}
+		CameraModel model;
+		calibration["camera_matrix"] >> model.intrinsic;
+		calibration["distortion_coefficients"] >> model.distortion;
+		int width = 0, height = 0;
+		calibration["image_width"] >> width;
+		calibration["image_height"] >> height;
+		if (model.intrinsic.rows != 3 || model.intrinsic.cols != 3 || model.distortion.empty()) {
+			job->log << filename << " is missing camera_matrix or distortion_coefficients" << endl;
+			return false;
+		}
+		model.intrinsic.convertTo(model.intrinsic, CV_64F);
+		model.distortion.convertTo(model.distortion, CV_64F);
+		model.calibrationSize = Size(width, height);
+		cameraModel = model;
+		if (PRINT_CAMERA_DEBUG) {
+			job->log << "Camera model from " << filename << ": \n" << cameraModel.intrinsic << "\n" << cameraModel.distortion << endl;
+		}
+		return true;
+	}
+	catch (Exception & e) {
+		job->log << e.what() << endl;
+		return false;
+	}
+}
+
+bool saveResult(Mat& src, string filename) {
+	try {
+		//false if the file couldn't be written, a missing folder or a full disk
+		if (!imwrite(filename, src)) {
+			job->log << "Problem writing " << filename << endl;
+			return false;
+		}
+		return true;
+	}
+	catch (Exception & e) {
+		job->log << e.what() << endl;
+		return false;
+	}
+}
+
+// Writes the features of every image and every pair matched this run, verified or not, to the match
+// cache (layout above MatchCache). Written to a temporary file first so a crash can't leave half a cache.
+bool saveMatches(string filename, const vector<PairMatch>& pairMatches) {
+	try {
+		string temporary = filename + ".tmp";
+		{
+			ofstream out(temporary, ios::binary | ios::trunc);
+			auto write = [&out](const void* data, size_t bytes) { out.write((const char*)data, streamsize(bytes)); };
+
+			uint32_t imageCount = uint32_t(job->imageSet.size()), pairCount = uint32_t(pairMatches.size());
+			write("ASCACHE3", 8);
+			write(&imageCount, sizeof(imageCount));
+			write(&pairCount, sizeof(pairCount));
+
+			for (subImage& image : job->imageSet) {
+				uint32_t keypointCount = uint32_t(image.keypoints.size());
+				uint32_t descriptorBytes = uint32_t(image.descriptors.cols);
+				write(&image.cacheKey, sizeof(image.cacheKey));
+				write(&keypointCount, sizeof(keypointCount));
+				write(&descriptorBytes, sizeof(descriptorBytes));
+				for (KeyPoint& keypoint : image.keypoints) {
+					int32_t octave = keypoint.octave, classId = keypoint.class_id;
+					write(&keypoint.pt.x, sizeof(float)); write(&keypoint.pt.y, sizeof(float)); write(&keypoint.size, sizeof(float));
+					write(&keypoint.angle, sizeof(float)); write(&keypoint.response, sizeof(float));
+					write(&octave, sizeof(octave)); write(&classId, sizeof(classId));
+				}
+				for (int r = 0; r < image.descriptors.rows; r++) {
+					write(image.descriptors.ptr<uchar>(r), descriptorBytes);
+				}
+			}
+
+			uint64_t parameters = matchParameterHash();
+			for (const PairMatch& pairMatch : pairMatches) {
+				uint32_t matchCount = uint32_t(pairMatch.goodMatches.size());
+				uint32_t hasHomography = !pairMatch.homo1.empty();
+				write(&job->imageSet[pairMatch.img1indx].cacheKey, sizeof(uint64_t));
+				write(&job->imageSet[pairMatch.img2indx].cacheKey, sizeof(uint64_t));
+				write(&parameters, sizeof(parameters));
+				write(&pairMatch.matchScore, sizeof(double));
+				write(&matchCount, sizeof(matchCount));
+				write(&hasHomography, sizeof(hasHomography));
+				Mat homo1 = Mat::zeros(3, 3, CV_64F);
+				if (hasHomography) {
+					pairMatch.homo1.convertTo(homo1, CV_64F);
+				}
+				write(homo1.ptr<double>(), 9 * sizeof(double));
+				for (const DMatch& match : pairMatch.goodMatches) {
+					int32_t queryIdx = match.queryIdx, trainIdx = match.trainIdx;
+					write(&queryIdx, sizeof(queryIdx));
+					write(&trainIdx, sizeof(trainIdx));
+					write(&match.distance, sizeof(float));
+				}
+			}
+			if (!out.good()) {
+				return false;
+			}
+		}
+		filesystem::rename(temporary, filename);
+		return true;
+	}
+	catch (const std::exception & e) {
+		job->log << e.what() << endl;
+		return false;
+	}
+}
+
+// 64-bit FNV-1a, chain calls by passing the previous hash back in
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash) {
+	const uchar* bytes = (const uchar*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Everything that changes the pixels or keypoints an image ends up with
+uint64_t featureParameterHash() {
+	string parameters = "features " + to_string(job->loadScale) + " " + to_string(UNDISTORT_ON_LOAD) + " "
+		+ to_string(FUSE_UNDISTORT_RESCALE) + " " + to_string(PIXEL_PADDING) + " " + to_string(ORB_POINT_COUNT) + " "
+		+ to_string(ORB_MIN_POINT_COUNT) + " " + to_string(ORB_CANDIDATE_FACTOR) + " " + to_string(FEATURE_GRID_SIZE);
+	uint64_t hash = hashBytes(parameters.data(), parameters.size());
+	if (UNDISTORT_ON_LOAD) {
+		hash = hashBytes(cameraModel.intrinsic.data, 9 * sizeof(double), hash);
+		hash = hashBytes(cameraModel.distortion.data, cameraModel.distortion.total() * sizeof(double), hash);
+		hash = hashBytes(&cameraModel.calibrationSize, sizeof(Size), hash);
+	}
+	return hash;
+}
+
+// Everything that changes a pair's matches, score or homographies given the same features
+uint64_t matchParameterHash() {
+	string parameters = "matches " + to_string(MATCH_RATIO_TEST) + " " + to_string(MATCH_CROSS_CHECK) + " "
+		+ to_string(job->imageMatchingThreshold) + " score mean homography " + to_string(HOMOGRAPHY_SOLVER_VERSION) + " "
+		+ to_string(HOMOGRAPHY_MATCHES) + " " + to_string(HOMOGRAPHY_THRESHOLD) + " " + to_string(HOMOGRAPHY_CONFIDENCE) + " "
+		+ to_string(HOMOGRAPHY_MAX_ITERATIONS);
+	return hashBytes(parameters.data(), parameters.size());
+}
+
+// Hash of the file's bytes combined with the preprocessing settings
+uint64_t imageCacheKey(const vector<uchar>& bytes) {
+	return hashBytes(bytes.data(), bytes.size(), featureParameterHash());
+}
+
+
+/* ------------- Preprocessing ------------ */
+
+Mat translateImg(Mat& img, Mat& target, int offsetx, int offsety) {
+	Mat trans_mat = (Mat_<double>(2, 3) << 1, 0, offsetx, 0, 1, offsety);
+	warpAffine(img, target, trans_mat, img.size());
+	return img;
+}
+
+// Smallest rectangle holding every pixel of img (8-bit, any channel count) that isn't all zero, empty if
+// the whole image is black. Rows are tested whole from the top and bottom until one has content, then
+// the rows between only look at the columns still outside the bounds, so the scan stops early on
+// anything but a black frame.
+Rect contentBounds(const Mat& img) {
+	int top = 0, bottom = img.rows - 1;
+	while (top <= bottom && countNonZero(img.row(top).reshape(1)) == 0) {
+		top++;
+	}
+	if (top > bottom) {
+		return Rect();
+	}
+	while (countNonZero(img.row(bottom).reshape(1)) == 0) {
+		bottom--;
+	}
+	//in bytes from here on, a pixel is elemSize of them
+	int pixelBytes = int(img.elemSize());
+	int left = img.cols * pixelBytes, right = -1;
+	for (int r = top; r <= bottom && (left > 0 || right < img.cols * pixelBytes - 1); r++) {
+		const uchar* row = img.ptr<uchar>(r);
+		for (int c = 0; c < left; c++) {
+			if (row[c]) {
+				left = c;
+				break;
+			}
+		}
+		for (int c = img.cols * pixelBytes - 1; c > right; c--) {
+			if (row[c]) {
+				right = c;
+				break;
+			}
+		}
+	}
+	return Rect(Point(left / pixelBytes, top), Point(right / pixelBytes + 1, bottom + 1));
+}
+
+// Pads img with black so it has PIXEL_PADDING of room on each side of its content, keeping its type.
+// mask (CV_8U, same size as img) gets the same padding so it stays aligned with the pixels, and offset
+// is where img's top left pixel ends up. The padding is a plain border copy, no interpolation.
+Mat addImagePadding(Mat& img, Mat& mask, Point& offset) {
+	//an all black image counts as having no margin
+	Rect content = contentBounds(img);
+	int currentPaddingTop = content.empty() ? 0 : content.y;
+	int currentPaddingLeft = content.empty() ? 0 : content.x;
+	int currentPaddingBottom = content.empty() ? 0 : img.rows - content.br().y;
+	int currentPaddingRight = content.empty() ? 0 : img.cols - content.br().x;
+	if (PRINT_PADDING_DEBUG) {
+		job->log << "Image is " << img.rows << " rows by " << img.cols << " cols" << endl;
+		job->log << "Top padding: " << currentPaddingTop << " Left padding: " << currentPaddingLeft << " Bottom padding: " << currentPaddingBottom << " Right padding: " << currentPaddingRight << endl;
+	}
+
+	int paddingNeededTop = max(0, PIXEL_PADDING - currentPaddingTop);
+	int paddingNeededLeft = max(0, PIXEL_PADDING - currentPaddingLeft);
+	int paddingNeededBottom = max(0, PIXEL_PADDING - currentPaddingBottom);
+	int paddingNeededRight = max(0, PIXEL_PADDING - currentPaddingRight);
+	offset = Point(paddingNeededLeft, paddingNeededTop);
+
+	Mat newImage;
+	copyMakeBorder(img, newImage, paddingNeededTop, paddingNeededBottom, paddingNeededLeft, paddingNeededRight, BORDER_CONSTANT, Scalar::all(0));
+	Mat newMask;
+	copyMakeBorder(mask, newMask, paddingNeededTop, paddingNeededBottom, paddingNeededLeft, paddingNeededRight, BORDER_CONSTANT, Scalar::all(0));
+	mask = newMask;
+	if (PRINT_PADDING_DEBUG) {
+		job->log << "new image dimensions " << newImage.rows << " rows by " << newImage.cols << " cols" << endl;
+	}
+	return newImage;
+}
+
+
+// Reloads an image's pixels if LAZY_IMAGE_PIXELS released them. Safe to call from worker threads,
+// callers needing the same image wait for whoever is loading it.
+void ensurePixels(int imgindx) {
+	static mutex pixelLocks[16];
+	lock_guard<mutex> guard(pixelLocks[imgindx % 16]);
+	if (job->imageSet[imgindx].img.empty()) {
+		TRACE_SPAN("reloadPixels");
+		TRACE_ARG("img", imgindx);
+		job->imageSet[imgindx].reloadPixels();
+	}
+}
+
+// Undistortion remap from a decoded source to the output size, built once per size pair and level. When
+// the sizes differ the table also does the rescale, by sampling the source at the scaled intrinsics.
+const UndistortMap& undistortMap(Size source, Size output, double levelScale) {
+	static map<tuple<int, int, int, int, double>, UndistortMap> maps;
+	static mutex mapsLock;
+	lock_guard<mutex> guard(mapsLock); // frames of one size wait for the first to build the table
+	auto key = make_tuple(source.width, source.height, output.width, output.height, levelScale);
+	auto found = maps.find(key);
+	if (found != maps.end()) {
+		return found->second;
+	}
+
+	Mat outputIntrinsic = cameraModel.intrinsicFor(output, levelScale);
+	Mat sourceIntrinsic = scaleIntrinsic(outputIntrinsic, double(source.width) / output.width, double(source.height) / output.height);
+	Mat camMatrix = getOptimalNewCameraMatrix(outputIntrinsic, cameraModel.distortion, output, 0); //make the actual transforma matrix 
+	if (PRINT_CAMERA_DEBUG) {
+		job->log << "Camera matrix: \n" << camMatrix << endl;
+	}
+	UndistortMap& undistortion = maps[key];
+	initUndistortRectifyMap(sourceIntrinsic, cameraModel.distortion, Mat(), camMatrix, output, CV_16SC2, undistortion.map1, undistortion.map2);
+	Mat sourceCoverage(source, CV_8U, Scalar(255));
+	remap(sourceCoverage, undistortion.coverage, undistortion.map1, undistortion.map2, INTER_LINEAR, BORDER_CONSTANT);
+	return undistortion;
+}
+
+// Blend weight per pixel: 0 outside coverage, ramping up to 255 at width pixels from the
+// nearest uncovered pixel or image edge
+void computeFeatherWeights(const Mat& coverage, Mat& weights, double width) {
+	//a zero border so the image edge counts as uncovered
+	Mat bordered, distance;
+	copyMakeBorder(coverage, bordered, 1, 1, 1, 1, BORDER_CONSTANT, Scalar(0));
+	distanceTransform(bordered, distance, DIST_L2, DIST_MASK_3);
+	distance(Rect(1, 1, coverage.cols, coverage.rows)).convertTo(weights, CV_8U, 255.0 / width);
+}
+
+
+/* --------------- Step 1 ----------------- */
+
+void computeFeatures(int imgindx) {
+	ensurePixels(imgindx);
+	TRACE_SPAN("computeFeatures");
+	subImage& image = job->imageSet[imgindx];
+
+	//intitate orb detector 
+	//Ptr<SIFT> detector = cv::xfeatures2d::SIFT::create;
+	//Ptr<FeatureDetector> detector = ORB::create();
+	//made once per thread and kept for every image and job after it, ORB isn't safe to share between threads
+	thread_local Ptr<FeatureDetector> detector = ORB::create(ORB_POINT_COUNT * ORB_CANDIDATE_FACTOR, 1.2, 8, 127, 0, 2, ORB::HARRIS_SCORE, 127, 20);
+	thread_local Ptr<DescriptorExtractor> descriptor = ORB::create();
+
+	//detect candidates, keep a budget of them spread over the image, and only describe those
+	detector->detect(image.img, image.keypoints);
+	bucketKeypoints(image.keypoints, image.contentRect);
+	descriptor->compute(image.img, image.keypoints, image.descriptors);
+	TRACE_ARG("img", imgindx);
+	TRACE_ARG("width", image.img.cols);
+	TRACE_ARG("height", image.img.rows);
+	TRACE_ARG("keypoints", image.keypoints.size());
+
+	//draw keypoints
+	//Mat outimg1;
+	//drawKeypoints(image.img, image.keypoints, outimg1, Scalar::all(-1), DrawMatchesFlags::DEFAULT);
+}
+
+// Thins candidates down to the image's budget, spread over a FEATURE_GRID_SIZE grid on area. Cells with
+// few candidates (sky, walls) keep all of theirs and the rest of the budget is shared out evenly between
+// the busier cells, strongest responses first. The budget itself grows from ORB_MIN_POINT_COUNT to
+// ORB_POINT_COUNT with the fraction of cells that are textured, so flat images cost less to match.
+void bucketKeypoints(vector<KeyPoint>& keypoints, Rect area) {
+	const int cellCount = FEATURE_GRID_SIZE * FEATURE_GRID_SIZE;
+	if (keypoints.empty() || area.empty()) {
+		return;
+	}
+	vector<vector<KeyPoint>> cells(cellCount);
+	for (KeyPoint& keypoint : keypoints) {
+		int col = clamp(int((keypoint.pt.x - area.x) * FEATURE_GRID_SIZE / area.width), 0, FEATURE_GRID_SIZE - 1);
+		int row = clamp(int((keypoint.pt.y - area.y) * FEATURE_GRID_SIZE / area.height), 0, FEATURE_GRID_SIZE - 1);
+		cells[row * FEATURE_GRID_SIZE + col].push_back(keypoint);
+	}
+
+	//a cell is textured if it has at least a quarter of an even share of the candidates
+	int texturedCells = 0;
+	for (vector<KeyPoint>& cell : cells) {
+		texturedCells += cell.size() * 4 * cellCount >= keypoints.size();
+	}
+	int budget = ORB_MIN_POINT_COUNT + (ORB_POINT_COUNT - ORB_MIN_POINT_COUNT) * texturedCells / cellCount;
+
+	//smallest cells first, each takes what it has up to an even share of what's left
+	vector<int> order(cellCount);
+	for (int c = 0; c < cellCount; c++) {
+		order[c] = c;
+	}
+	sort(order.begin(), order.end(), [&cells](int a, int b) { return cells[a].size() < cells[b].size(); });
+	vector<KeyPoint> kept;
+	kept.reserve(budget);
+	for (int k = 0; k < cellCount; k++) {
+		vector<KeyPoint>& cell = cells[order[k]];
+		int quota = (budget - int(kept.size())) / (cellCount - k);
+		if (cell.size() > quota) {
+			nth_element(cell.begin(), cell.begin() + quota, cell.end(),
+				[](const KeyPoint& a, const KeyPoint& b) { return a.response > b.response; });
+			cell.resize(quota);
+		}
+		kept.insert(kept.end(), cell.begin(), cell.end());
+	}
+	keypoints = kept;
+}
+
+// Small sets match every pair. Bigger ones describe each image as a tf-idf weighted histogram of
+// visual words and only match each image against its CANDIDATE_NEIGHBOURS most similar images,
+// so the expensive FindMatches calls grow with n * k instead of n^2.
+vector<PairMatch> selectCandidatePairs() {
+	int imageCount = int(job->imageSet.size());
+	vector<pair<int, int>> pairs;
+
+	if (imageCount <= EXHAUSTIVE_MATCHING_LIMIT || CANDIDATE_NEIGHBOURS >= imageCount - 1) {
+		for (int i = 0; i < imageCount; i++) {
+			for (int j = i + 1; j < imageCount; j++) {
+				pairs.push_back(make_pair(i, j));
+			}
+		}
+	}
+	else {
+		Mat vocabulary = buildVocabulary();
+		vector<Mat> signatures(imageCount);
+		workerPool.parallelFor(imageCount, [&](int i) {
+			signatures[i] = bowSignature(vocabulary, job->imageSet[i].descriptors);
+		});
+
+		//words that show up in every image say nothing about overlap, weight them down (idf)
+		vector<int> documentFrequency(vocabulary.rows, 0);
+		for (Mat& signature : signatures) {
+			for (int w = 0; w < vocabulary.rows; w++) {
+				if (signature.at<float>(0, w) > 0) {
+					documentFrequency[w]++;
+				}
+			}
+		}
+		for (Mat& signature : signatures) {
+			for (int w = 0; w < vocabulary.rows; w++) {
+				signature.at<float>(0, w) *= float(log(double(imageCount) / double(max(1, documentFrequency[w]))));
+			}
+			double length = norm(signature);
+			if (length > 0) {
+				signature /= length;
+			}
+		}
+
+		//keep the k most similar images for each image
+		vector<vector<int>> neighbours(imageCount);
+		workerPool.parallelFor(imageCount, [&](int i) {
+			vector<pair<double, int>> similarities;
+			for (int j = 0; j < imageCount; j++) {
+				if (j != i) {
+					similarities.push_back(make_pair(-signatures[i].dot(signatures[j]), j)); // negated so the best sort first
+				}
+			}
+			partial_sort(similarities.begin(), similarities.begin() + CANDIDATE_NEIGHBOURS, similarities.end());
+			for (int k = 0; k < CANDIDATE_NEIGHBOURS; k++) {
+				neighbours[i].push_back(similarities[k].second);
+			}
+		});
+		//a pair is matched if either image picked the other
+		for (int i = 0; i < imageCount; i++) {
+			for (int j : neighbours[i]) {
+				pairs.push_back(make_pair(min(i, j), max(i, j)));
+			}
+		}
+		sort(pairs.begin(), pairs.end());
+		pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+	}
+
+	vector<PairMatch> pairMatches(pairs.size());
+	for (int p = 0; p < pairs.size(); p++) {
+		pairMatches[p].img1indx = pairs[p].first;
+		pairMatches[p].img2indx = pairs[p].second;
+	}
+	return pairMatches;
+}
+
+// Trains VOCABULARY_SIZE binary visual words with k-majority clustering (k-means where each
+// centre is the bitwise majority of its members) on descriptors sampled evenly from the set.
+Mat buildVocabulary() {
+	int totalDescriptors = 0;
+	for (subImage& image : job->imageSet) {
+		totalDescriptors += image.descriptors.rows;
+	}
+	int stride = max(1, totalDescriptors / VOCABULARY_SAMPLES);
+	Mat samples;
+	int seen = 0;
+	for (subImage& image : job->imageSet) {
+		for (int r = 0; r < image.descriptors.rows; r++, seen++) {
+			if (seen % stride == 0) {
+				samples.push_back(image.descriptors.row(r));
+			}
+		}
+	}
+	if (samples.empty()) {
+		return samples;
+	}
+
+	//seed the words with evenly spaced samples so the vocabulary is the same every run
+	int wordCount = min(VOCABULARY_SIZE, samples.rows);
+	Mat vocabulary(wordCount, samples.cols, CV_8U);
+	for (int w = 0; w < wordCount; w++) {
+		samples.row(int(double(w) * samples.rows / wordCount)).copyTo(vocabulary.row(w));
+	}
+
+	vector<int> assignment(samples.rows);
+	for (int iteration = 0; iteration < VOCABULARY_ITERATIONS; iteration++) {
+		workerPool.parallelFor(samples.rows, [&](int s) {
+			assignment[s] = nearestWord(vocabulary, samples.ptr<uchar>(s));
+		});
+		//each word becomes the bitwise majority of the samples assigned to it
+		int bits = samples.cols * 8;
+		vector<int> bitCounts(wordCount * bits, 0);
+		vector<int> members(wordCount, 0);
+		for (int s = 0; s < samples.rows; s++) {
+			const uchar* descriptor = samples.ptr<uchar>(s);
+			int* counts = &bitCounts[assignment[s] * bits];
+			for (int b = 0; b < bits; b++) {
+				counts[b] += (descriptor[b / 8] >> (b % 8)) & 1;
+			}
+			members[assignment[s]]++;
+		}
+		for (int w = 0; w < wordCount; w++) {
+			if (members[w] == 0) {
+				continue; // keep the old word rather than an empty one
+			}
+			uchar* word = vocabulary.ptr<uchar>(w);
+			const int* counts = &bitCounts[w * bits];
+			for (int byte = 0; byte < samples.cols; byte++) {
+				uchar value = 0;
+				for (int b = 0; b < 8; b++) {
+					if (counts[byte * 8 + b] * 2 > members[w]) {
+						value |= uchar(1 << b);
+					}
+				}
+				word[byte] = value;
+			}
+		}
+	}
+	return vocabulary;
+}
+
+// Histogram of the visual words in one image (1 x words, CV_32F)
+Mat bowSignature(Mat& vocabulary, Mat& descriptors) {
+	Mat signature = Mat::zeros(1, max(1, vocabulary.rows), CV_32F);
+	if (vocabulary.empty()) {
+		return signature;
+	}
+	for (int r = 0; r < descriptors.rows; r++) {
+		signature.at<float>(0, nearestWord(vocabulary, descriptors.ptr<uchar>(r)))++;
+	}
+	return signature;
+}
+
+int nearestWord(Mat& vocabulary, const uchar* descriptor) {
+	int best = 0;
+	int bestDistance = INT_MAX;
+	for (int w = 0; w < vocabulary.rows; w++) {
+		int distance = hammingDistance(descriptor, vocabulary.ptr<uchar>(w), vocabulary.cols);
+		if (distance < bestDistance) {
+			bestDistance = distance;
+			best = w;
+		}
+	}
+	return best;
+}
+
+static inline int popcount64(uint64_t x) {
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return int((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Hamming distance between two 32 byte ORB descriptors
+static inline int hammingDistance32(const uchar* a, const uchar* b) {
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+	__m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+	__m256i counts = _mm256_popcnt_epi64(x);
+#elif defined(__AVX2__)
+	//popcount each nibble with a shuffle lookup, then sum the bytes with sad
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i lowNibble = _mm256_set1_epi8(0x0f);
+	__m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+	__m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, lowNibble)),
+		_mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowNibble)));
+	__m256i counts = _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+#endif
+#if defined(__AVX2__) || (defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__))
+	__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(counts), _mm256_extracti128_si256(counts, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	return _mm_cvtsi128_si32(sum);
+#else
+	uint64_t wordsA[4], wordsB[4];
+	memcpy(wordsA, a, 32);
+	memcpy(wordsB, b, 32);
+	return popcount64(wordsA[0] ^ wordsB[0]) + popcount64(wordsA[1] ^ wordsB[1])
+		+ popcount64(wordsA[2] ^ wordsB[2]) + popcount64(wordsA[3] ^ wordsB[3]);
+#endif
+}
+
+int hammingDistance(const uchar* a, const uchar* b, int bytes) {
+	if (bytes == 32) {
+		return hammingDistance32(a, b);
+	}
+	return hal::normHamming(a, b, bytes);
+}
+
+// Brute force matcher for binary descriptors. One pass over every query/train pair keeps the best
+// and second best distance per query (for the ratio test) and the best query per train descriptor
+// (for the cross-check), so neither filter needs a second matching run.
+// matches gets the nearest neighbour of every query, goodMatches the ones that pass the filters.
+void matchHamming(const Mat& query, const Mat& train, double ratio, bool crossCheck, vector<DMatch>& matches, vector<DMatch>& goodMatches) {
+	matches.clear();
+	goodMatches.clear();
+	if (query.empty() || train.empty()) {
+		return;
+	}
+	CV_Assert(query.type() == CV_8U && train.type() == CV_8U && query.cols == train.cols);
+
+	int bytes = query.cols;
+	vector<int> secondDistance(query.rows, INT_MAX);
+	vector<int> bestQuery(train.rows, -1);
+	vector<int> bestQueryDistance(train.rows, INT_MAX);
+	matches.resize(query.rows);
+
+	for (int q = 0; q < query.rows; q++) {
+		const uchar* queryDescriptor = query.ptr<uchar>(q);
+		int best = INT_MAX, second = INT_MAX, bestTrain = 0;
+		for (int t = 0; t < train.rows; t++) {
+			int distance = (bytes == 32) ? hammingDistance32(queryDescriptor, train.ptr<uchar>(t))
+				: hal::normHamming(queryDescriptor, train.ptr<uchar>(t), bytes);
+			if (distance < best) {
+				second = best;
+				best = distance;
+				bestTrain = t;
+			}
+			else if (distance < second) {
+				second = distance;
+			}
+			if (distance < bestQueryDistance[t]) {
+				bestQueryDistance[t] = distance;
+				bestQuery[t] = q;
+			}
+		}
+		matches[q] = DMatch(q, bestTrain, float(best));
+		secondDistance[q] = second;
+	}
+
+	for (int q = 0; q < query.rows; q++) {
+		const DMatch& match = matches[q];
+		//with one train descriptor there is no second best, so the ratio test passes
+		bool distinctive = secondDistance[q] == INT_MAX || match.distance < ratio * secondDistance[q];
+		bool mutual = !crossCheck || bestQuery[match.trainIdx] == q;
+		if (distinctive && mutual) {
+			goodMatches.push_back(match);
+		}
+	}
+}
+
+// Micro-benchmark: matchHamming against OpenCV's BFMatcher on consecutive pairs of a folder.
+// Both are timed doing the same job, nearest two neighbours for the ratio test and a cross-checked match.
+void benchmarkHammingMatcher(string folderPath) {
+	const int repeats = 20;
+	if (!importImages(folderPath)) {
+		job->log << "Problem importing images!" << endl;
+		return;
+	}
+	workerPool.parallelFor(int(job->imageSet.size()), [](int i) { computeFeatures(i); });
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+	job->log << "Hamming matcher using AVX-512 VPOPCNTDQ" << endl;
+#elif defined(__AVX2__)
+	job->log << "Hamming matcher using AVX2" << endl;
+#else
+	job->log << "Hamming matcher using scalar popcount" << endl;
+#endif
+
+	double totalOpenCV = 0, totalOurs = 0;
+	for (int i = 0; i + 1 < job->imageSet.size(); i++) {
+		Mat& descriptors_1 = job->imageSet[i].descriptors;
+		Mat& descriptors_2 = job->imageSet[i + 1].descriptors;
+
+		BFMatcher knnMatcher(NORM_HAMMING);
+		BFMatcher crossCheckMatcher(NORM_HAMMING, true);
+		vector<vector<DMatch>> knnMatches;
+		vector<DMatch> crossChecked;
+		auto startStep = high_resolution_clock::now();
+		for (int r = 0; r < repeats; r++) {
+			knnMatcher.knnMatch(descriptors_1, descriptors_2, knnMatches, 2);
+			crossCheckMatcher.match(descriptors_1, descriptors_2, crossChecked);
+		}
+		double openCVTime = duration_cast<microseconds>(high_resolution_clock::now() - startStep).count() / double(repeats);
+
+		vector<DMatch> matches, goodMatches;
+		startStep = high_resolution_clock::now();
+		for (int r = 0; r < repeats; r++) {
+			matchHamming(descriptors_1, descriptors_2, MATCH_RATIO_TEST, true, matches, goodMatches);
+		}
+		double ourTime = duration_cast<microseconds>(high_resolution_clock::now() - startStep).count() / double(repeats);
+
+		//nearest neighbour distances must agree with OpenCV (indices can differ on ties)
+		int agreeing = 0;
+		for (int q = 0; q < knnMatches.size() && q < matches.size(); q++) {
+			if (!knnMatches[q].empty() && knnMatches[q][0].distance == matches[q].distance) {
+				agreeing++;
+			}
+		}
+		totalOpenCV += openCVTime;
+		totalOurs += ourTime;
+		printf("-Images %d and %d (%d x %d descriptors)-\n", i, i + 1, descriptors_1.rows, descriptors_2.rows);
+		printf("-- BFMatcher knn + cross-check : %.1f us \n", openCVTime);
+		printf("-- matchHamming               : %.1f us (%.2fx), %d good matches, %d/%d nearest distances agree \n",
+			ourTime, openCVTime / max(ourTime, 1.0), int(goodMatches.size()), agreeing, int(matches.size()));
 	}
-	//match score is the average of all the distances
-	matchScore = double(double(matchScore) / double(ORB_POINT_COUNT));
+	printf("Total BFMatcher %.1f us, matchHamming %.1f us, speedup %.2fx \n", totalOpenCV, totalOurs, totalOpenCV / max(totalOurs, 1.0));
+}
 
+PairMatch FindMatches(int img1indx, int img2indx) {
+	TRACE_SPAN("FindMatches");
+	auto start = high_resolution_clock::now();
+	PairMatch match;
+	match.img1indx = img1indx;
+	match.img2indx = img2indx;
 
-	printf("-Matches between img %d and %d -\n", img1indx, img2indx);
-	//printf("-- Max dist : %f \n", max_dist);
-	//printf("-- Min dist : %f \n", min_dist);
-	printf("-- Match score : %f \n", matchScore);
+	double matchScore = 0;
+	// keypoints and descriptors were computed once per image by computeFeatures
+	Mat& descriptors_1 = job->imageSet[img1indx].descriptors;
+	Mat& descriptors_2 = job->imageSet[img2indx].descriptors;
 
+	//nearest neighbour of every descriptor, plus the ones that pass the ratio test and cross-check
+	vector<DMatch> matches;
 	std::vector< DMatch > good_matches;
-	//When the distance between the descriptors is 
-	//greater than twice the minimum distance, the match is considered to be incorrect. 
-	//But sometimes the minimum distance will be very small, and an empirical value of 30 is set as the lower limit.
-	for (int i = 0; i < descriptors_1.rows; i++)
+	matchHamming(descriptors_1, descriptors_2, MATCH_RATIO_TEST, MATCH_CROSS_CHECK, matches, good_matches);
+
+	//score from every nearest neighbour distance, not only the good ones
+	for (int i = 0; i < matches.size(); i++)
 	{
-		if (matches[i].distance <= max(2 * min_dist, 30.0))
-		{
-			good_matches.push_back(matches[i]);
-		}
+		double dist = matches[i].distance;
+		matchScore += (1 + dist) * (1 + dist);
+	}
+	//match score is the mean over the descriptors actually matched. An image with the full ORB_POINT_COUNT
+	//budget scores as it always did, and one that bucketing left with fewer isn't made to look a better match
+	matchScore = double(double(matchScore) / double(max<size_t>(1, matches.size())));
+
+	//best matches first, the homography solver in Step 2 samples in this order
+	sort(good_matches.begin(), good_matches.end(), [](const DMatch& a, const DMatch& b) { return a.distance < b.distance; });
+
+	//put the good points and the score of all points in the match result
+	match.goodMatches = good_matches;
+	match.matchScore = matchScore;
+	match.matchMicros = double(duration_cast<microseconds>(high_resolution_clock::now() - start).count());
+	TRACE_ARG("img1", img1indx);
+	TRACE_ARG("img2", img2indx);
+	TRACE_ARG("descriptors1", descriptors_1.rows);
+	TRACE_ARG("descriptors2", descriptors_2.rows);
+	TRACE_ARG("goodMatches", good_matches.size());
+	return match;
+}
+
+// Runs on the calling thread after the workers are done, so printing and HighGUI stay serial
+void reportPairMatch(PairMatch& match) {
+	int img1indx = match.img1indx;
+	int img2indx = match.img2indx;
+
+	job->log << "-Matches between img " << img1indx << " and " << img2indx << " -" << endl;
+	job->log << "-- Match score : " << match.matchScore << " " << endl;
+	if (PRINT_MATCHES_DEBUG && match.ransacPoints > 0) {
+		job->log << "-- " << match.goodMatches.size() << " good matches, " << match.ransacInliers << " of " << match.ransacPoints
+			<< " inliers (" << cvRound(100.0 * match.ransacInliers / match.ransacPoints) << "%) after " << match.ransacIterations
+			<< " iterations, " << cvRound(match.matchMicros) << " us matching, " << cvRound(match.solveMicros) << " us solving " << endl;
 	}
 
 	Mat img_goodmatch;
 	//-- Draw results 
 	if (IMAGE_MATCHING_DISPLAY) {
-
-		//drawMatches(img_1, keypoints_1, img_2, keypoints_2, matches, img_match);
-		drawMatches(img_1, keypoints_1, img_2, keypoints_2, good_matches, img_goodmatch);
-		//namedWindow("matches", WINDOW_NORMAL);
-		//imshow("matches", img_match);
-		//resizeWindow("matches", 600, 600);
+		ensurePixels(img1indx);
+		ensurePixels(img2indx);
+		drawMatches(job->imageSet[img1indx].img, job->imageSet[img1indx].keypoints, job->imageSet[img2indx].img, job->imageSet[img2indx].keypoints, match.goodMatches, img_goodmatch);
 		string window = "good matches between " + to_string(img1indx) + " and " + to_string(img2indx);
 		namedWindow(window, WINDOW_NORMAL);
 		imshow(window, img_goodmatch);
 		resizeWindow(window, 800, 800);
+		if (LAZY_IMAGE_PIXELS) {
+			job->imageSet[img1indx].releasePixels();
+			job->imageSet[img2indx].releasePixels();
+		}
 	}
-	//estimate affine transfomation 
-	//get points to use 
-	if (IMAGE_MATCHING_DEBUG) {
-		//cout << "points used to calc transform" << endl;
+	if (IMAGE_MATCHING_DEBUG && !match.homo1.empty()) {
+		job->log << "Transfomation Matrix" << endl;
+		job->log << match.homo1 << endl;
 	}
+}
+
+
+/* --------------- Step 2 ----------------- */
+
+// Estimates the homography mapping img2 onto img1 from the pair's ranked good matches, the match graph
+// inverts it for the other direction
+void solveTransforms(PairMatch& match) {
+	TRACE_SPAN("solveTransforms");
+	auto start = high_resolution_clock::now();
+	vector<KeyPoint>& keypoints_1 = job->imageSet[match.img1indx].keypoints;
+	vector<KeyPoint>& keypoints_2 = job->imageSet[match.img2indx].keypoints;
+	//get the good points, take the top HOMOGRAPHY_MATCHES
 	vector<Point2d> transformPtsImg1;
 	vector<Point2d> transformPtsImg2;
-	//get the good points, take top 60
-	for (int i = 0; (i < good_matches.size() && i < 60); i++) {
-		transformPtsImg1.push_back(keypoints_1[good_matches[i].queryIdx].pt);
-		transformPtsImg2.push_back(keypoints_2[good_matches[i].trainIdx].pt);
-		if (IMAGE_MATCHING_DEBUG) {
-			//cout << transformPtsImg1[i] << " -> " << transformPtsImg2[i] << endl;
-		}
+	for (int i = 0; (i < match.goodMatches.size() && i < HOMOGRAPHY_MATCHES); i++) {
+		transformPtsImg1.push_back(keypoints_1[match.goodMatches[i].queryIdx].pt);
+		transformPtsImg2.push_back(keypoints_2[match.goodMatches[i].trainIdx].pt);
+	}
+
+	//find the transform
+	vector<uchar> inliers;
+	match.homo1 = prosacHomography(transformPtsImg2, transformPtsImg1, inliers, match.ransacIterations);
+	match.ransacPoints = int(transformPtsImg1.size());
+	match.ransacInliers = int(count(inliers.begin(), inliers.end(), 1));
+	match.solveMicros = double(duration_cast<microseconds>(high_resolution_clock::now() - start).count());
+	TRACE_ARG("img1", match.img1indx);
+	TRACE_ARG("img2", match.img2indx);
+	TRACE_ARG("points", match.ransacPoints);
+	TRACE_ARG("inliers", match.ransacInliers);
+	TRACE_ARG("iterations", match.ransacIterations);
+}
+
+// PROSAC: minimal samples are drawn from the best ranked matches first and the pool widens on the standard
+// growth schedule, so a good pair is usually solved within a few iterations rather than RANSAC's uniform
+// draws. Stops once HOMOGRAPHY_CONFIDENCE says a better model is unlikely, then refits on the inliers only.
+// src and dst must be ordered best match first. Returns an empty Mat with fewer than 4 matches.
+Mat prosacHomography(const vector<Point2d>& src, const vector<Point2d>& dst, vector<uchar>& inlierMask, int& iterations) {
+	const int sampleSize = 4;
+	int count = int(src.size());
+	iterations = 0;
+	inlierMask.assign(count, 0);
+	if (count < sampleSize) {
+		return Mat();
 	}
-	//put the good points and the score of all points in the image set data
-	imageSet[img1indx].goodMatches[img2indx] = good_matches;
-	imageSet[img1indx].goodMatchScores[img2indx] = matchScore;
-	imageSet[img2indx].goodMatches[img1indx] = good_matches;
-	imageSet[img2indx].goodMatchScores[img1indx] = matchScore;
 
-	//solve transforms if this match is good enough
-	if (matchScore < imageMatchingThreshold + 50) {
-		solveTransforms(transformPtsImg1, transformPtsImg2, img1indx, img2indx);
+	//T_n, the expected number of samples drawn from the top n matches out of HOMOGRAPHY_MAX_ITERATIONS
+	double expectedSamples = HOMOGRAPHY_MAX_ITERATIONS;
+	for (int i = 0; i < sampleSize; i++) {
+		expectedSamples *= double(sampleSize - i) / double(count - i);
 	}
+	int poolSize = sampleSize; // n
+	double poolSamples = 1; // T'_n, iteration at which the pool grows to n + 1
+	RNG rng((uint64)count); // fixed seed so reruns give the same homography
+
+	Mat bestHomo;
+	int bestInliers = 0;
+	double requiredIterations = HOMOGRAPHY_MAX_ITERATIONS;
+	vector<uchar> mask(count);
+	while (iterations < requiredIterations && iterations < HOMOGRAPHY_MAX_ITERATIONS) {
+		iterations++;
+		if (iterations >= poolSamples && poolSize < count) {
+			double nextSamples = expectedSamples * (poolSize + 1) / (poolSize + 1 - sampleSize);
+			poolSamples += ceil(nextSamples - expectedSamples);
+			expectedSamples = nextSamples;
+			poolSize++;
+		}
 
-}
+		//the newest match in the pool is always in the sample until the pool grows again
+		int sample[sampleSize];
+		int drawn = 0;
+		if (poolSamples >= iterations && poolSize < count) {
+			sample[drawn++] = poolSize - 1;
+		}
+		while (drawn < sampleSize) {
+			int candidate = rng.uniform(0, poolSize - (drawn > 0 && sample[0] == poolSize - 1 ? 1 : 0));
+			bool repeated = false;
+			for (int k = 0; k < drawn; k++) {
+				repeated |= sample[k] == candidate;
+			}
+			if (!repeated) {
+				sample[drawn++] = candidate;
+			}
+		}
 
+		Point2f sampleSrc[sampleSize], sampleDst[sampleSize];
+		for (int k = 0; k < sampleSize; k++) {
+			sampleSrc[k] = Point2f(float(src[sample[k]].x), float(src[sample[k]].y));
+			sampleDst[k] = Point2f(float(dst[sample[k]].x), float(dst[sample[k]].y));
+		}
+		//three points on a line give no unique homography
+		bool degenerate = false;
+		for (int a = 0; a < sampleSize && !degenerate; a++) {
+			Point2f p[3], q[3];
+			for (int k = 0, m = 0; k < sampleSize; k++) {
+				if (k != a) {
+					p[m] = sampleSrc[k];
+					q[m++] = sampleDst[k];
+				}
+			}
+			degenerate = fabs((p[1] - p[0]).cross(p[2] - p[0])) < 1 || fabs((q[1] - q[0]).cross(q[2] - q[0])) < 1;
+		}
+		if (degenerate) {
+			continue;
+		}
 
-/* --------------- Step 2 ----------------- */
+		Mat homo = getPerspectiveTransform(sampleSrc, sampleDst);
+		if (homo.empty() || !checkRange(homo)) {
+			continue;
+		}
+		int inliers = countInliers(homo, src, dst, mask);
+		if (inliers > bestInliers) {
+			bestInliers = inliers;
+			bestHomo = homo;
+			inlierMask = mask;
+			//early exit: iterations needed to have drawn an all-inlier sample with the chosen confidence
+			double allInliers = pow(double(inliers) / count, sampleSize);
+			requiredIterations = allInliers >= 1 ? 0 : log(1 - HOMOGRAPHY_CONFIDENCE) / log(1 - allInliers);
+		}
+	}
+	if (bestHomo.empty()) {
+		return Mat();
+	}
 
-void solveTransforms(vector<Point2d>& transformPtsImg1, vector<Point2d>& transformPtsImg2, int img1indx, int img2indx) {
-	
-	//find the transform
-	Mat homo1 = findHomography(transformPtsImg2, transformPtsImg1, RANSAC, 5.0);
-	if (IMAGE_MATCHING_DEBUG) {
-		cout << "Transfomation Matrix" << endl;
-		cout << homo1 << endl;
+	//least squares refit on the inliers only, kept if it doesn't lose any
+	vector<Point2d> inlierSrc, inlierDst;
+	for (int i = 0; i < count; i++) {
+		if (inlierMask[i]) {
+			inlierSrc.push_back(src[i]);
+			inlierDst.push_back(dst[i]);
+		}
 	}
-	Mat homo2 = findHomography(transformPtsImg1, transformPtsImg2, RANSAC, 5.0);
-	if (IMAGE_MATCHING_DEBUG) {
-		cout << "Transfomation Matrix" << endl;
-		cout << homo2 << endl;
+	Mat refined = findHomography(inlierSrc, inlierDst, 0);
+	if (!refined.empty() && countInliers(refined, src, dst, mask) >= bestInliers) {
+		bestHomo = refined;
+		inlierMask = mask;
+	}
+	return bestHomo;
+}
+
+// Marks and counts the matches homo maps within HOMOGRAPHY_THRESHOLD of their partner
+int countInliers(const Mat& homo, const vector<Point2d>& src, const vector<Point2d>& dst, vector<uchar>& inlierMask) {
+	Mat_<double> h;
+	homo.convertTo(h, CV_64F);
+	const double threshold = HOMOGRAPHY_THRESHOLD * HOMOGRAPHY_THRESHOLD;
+	int inliers = 0;
+	for (int i = 0; i < src.size(); i++) {
+		double x = src[i].x, y = src[i].y;
+		double w = h(2, 0) * x + h(2, 1) * y + h(2, 2);
+		double dx = (h(0, 0) * x + h(0, 1) * y + h(0, 2)) / w - dst[i].x;
+		double dy = (h(1, 0) * x + h(1, 1) * y + h(1, 2)) / w - dst[i].y;
+		inlierMask[i] = fabs(w) > DBL_EPSILON && dx * dx + dy * dy < threshold;
+		inliers += inlierMask[i];
 	}
-	//put in the dataset for later
-	imageSet[img1indx].homographyMatrixes[img2indx] = homo1;
-	imageSet[img2indx].homographyMatrixes[img1indx] = homo2;
+	return inliers;
 }
 
 /* --------------- Step 3 ----------------- */
@@ -601,15 +2725,16 @@ void solveTransforms(vector<Point2d>& transformPtsImg1, vector<Point2d>& transfo
 
 int findCenterImage() {
 	int minindex = 0;
-	vector<int> sums;
-	for (int i = 0; i < imageSet.size(); i++) {
-		int sum = 0;
-		for (int j = 0; j < imageSet.size(); j++) {
-			sum += imageSet[i].goodMatchScores[j];
+	vector<double> sums;
+	for (int i = 0; i < job->imageSet.size(); i++) {
+		//pairs without an edge count as unmatched
+		double sum = double(job->imageSet.size() - 1 - job->matchGraph.degree(i)) * UNMATCHED_MATCH_SCORE;
+		for (auto n = job->matchGraph.neighboursBegin(i); n != job->matchGraph.neighboursEnd(i); n++) {
+			sum += job->matchGraph.edge(n->edge).score;
 		}
 		sums.push_back(sum);
 	}
-	for (int i = 0; i < imageSet.size(); i++) {
+	for (int i = 0; i < job->imageSet.size(); i++) {
 		if (sums[i] < sums[minindex]) {
 			minindex = i;
 		}
@@ -617,113 +2742,1015 @@ int findCenterImage() {
 	return minindex;
 }
 
-Path generateAssemblyPath() {
-	// 
-	PathNode test;
-	test.path[0] = 1; test.path[1] = 1;
+// Prim's algorithm from the center image over the pairs that matched well enough. Lower scores are
+// better matches, so always taking the lowest score edge gives the maximum-similarity spanning tree.
+// Nodes come out parents first, and each image's transform into the center image is its parent's
+// transform chained with the pair homography. Images with no good enough match are left out.
+// The edges leaving the tree wait in a priority queue, so the tree is built in O(E log N) rather than
+// rescanning every tree node's neighbours for each image added. Ties go to the parent that joined the tree
+// first, then the lower image index.
+Path generateAssemblyPath(int centerimgIndex) {
 	Path assemblyPath;
-	assemblyPath.push_back(test);
-
+	int imageCount = int(job->imageSet.size());
+	vector<bool> inTree(imageCount, false);
+	job->imagesInComposite.clear();
+	//score, when the parent joined the tree, child, parent; stale once the child is in the tree
+	priority_queue<tuple<double, int, int, int>, vector<tuple<double, int, int, int>>, greater<tuple<double, int, int, int>>> frontier;
+	auto addToTree = [&](int img) {
+		inTree[img] = true;
+		int joined = int(job->imagesInComposite.size());
+		job->imagesInComposite.push_back(img);
+		for (auto n = job->matchGraph.neighboursBegin(img); n != job->matchGraph.neighboursEnd(img); n++) {
+			double score = job->matchGraph.edge(n->edge).score;
+			if (!inTree[n->image] && score < job->imageMatchingThreshold) {
+				frontier.push(make_tuple(score, joined, n->image, img));
+			}
+		}
+	};
+	job->imageSet[centerimgIndex].referenceTransform = Mat::eye(3, 3, CV_64F);
+	addToTree(centerimgIndex);
+
+	while (!frontier.empty()) {
+		double bestScore = get<0>(frontier.top());
+		int child = get<2>(frontier.top()), parent = get<3>(frontier.top());
+		frontier.pop();
+		if (inTree[child]) {
+			continue;
+		}
+		PathNode best;
+		best.path[0] = parent;
+		best.path[1] = child;
+		Mat pairHomo = job->matchGraph.homography(parent, child);
+		job->imageSet[child].referenceTransform = job->imageSet[parent].referenceTransform * pairHomo;
+		addToTree(child);
+		assemblyPath.push_back(best);
+		if (PRINT_CONSOLE_DEBUG) {
+			job->log << "Assembly: img " << child << " attaches to img " << parent << " (score " << bestScore << ")" << endl;
+		}
+	}
+	if (PRINT_CONSOLE_DEBUG && job->imagesInComposite.size() < job->imageSet.size()) {
+		job->log << job->imageSet.size() - job->imagesInComposite.size() << " image(s) had no good enough match and are left out" << endl;
+	}
 	return assemblyPath;
-	
 }
 
-Mat composite2Images(Mat& composite, int img1indx, int img2indx,bool useImageSpecified,Mat& imageSpecified) {
-	//Mat& img_1 = imageSet[img1indx].img;
-	Mat& img_1 = composite;
-	Mat& img_2 = imageSet[img2indx].img;
-	if (useImageSpecified) {
-		img_2 = imageSpecified;
+// Moves the assembly from the matching scale up to the job's compositeScale. Each edge of the assembly path
+// has its homography lifted to the composite scale and then corrected from a few of its best matches, re-located
+// there by correlating small patches around where the lifted homography puts them. The corrected edges are
+// chained from the center as before. Pixels are rebuilt at the composite scale, unpadded, as they're needed.
+// Edges go a worker pool's worth at a time, each image's grey level is built once, by the first batch with an
+// edge on it, and its pixels are let go straight away with LAZY_IMAGE_PIXELS. The grey level is kept until the
+// image's last edge is refined, so only the images with edges still to come are held at the composite scale.
+void refineToCompositeScale(int centerimgIndex) {
+	vector<Mat> edgeHomos(job->compositeImagePath.size());
+	//lifted matching level homographies, while contentRect and levelTransform still describe that level
+	for (int e = 0; e < job->compositeImagePath.size(); e++) {
+		int parent = job->compositeImagePath[e].path[0], child = job->compositeImagePath[e].path[1];
+		edgeHomos[e] = job->imageSet[parent].levelTransform.inv() * job->matchGraph.homography(parent, child) * job->imageSet[child].levelTransform;
 	}
-	
-	Mat homo = imageSet[img1indx].homographyMatrixes[img2indx];
+	vector<Rect> contentRects(job->imageSet.size());
+	for (int i = 0; i < job->imageSet.size(); i++) {
+		subImage& image = job->imageSet[i];
+		//the content rect at the new scale until the pixels are rebuilt and give the exact one
+		Rect padded = image.contentRect - image.paddingOffset;
+		double s = job->compositeScale / job->loadScale;
+		contentRects[i] = Rect(Point(int(floor(padded.x * s)), int(floor(padded.y * s))), Point(int(ceil(padded.br().x * s)), int(ceil(padded.br().y * s))));
+		image.releasePixels();
+	}
+
+	job->pixelScale = job->compositeScale;
+	for (int i = 0; i < job->imageSet.size(); i++) {
+		job->imageSet[i].contentRect = contentRects[i];
+		job->imageSet[i].paddingOffset = Point(0, 0);
+	}
+	vector<Mat> greys(job->imageSet.size());
+	vector<int> edgesLeft(job->imageSet.size(), 0);
+	for (int e = 0; e < job->compositeImagePath.size(); e++) {
+		edgesLeft[job->compositeImagePath[e].path[0]]++;
+		edgesLeft[job->compositeImagePath[e].path[1]]++;
+	}
+	atomic<int> refined{ 0 };
+	int pathSize = int(job->compositeImagePath.size());
+	for (int first = 0; first < pathSize; first += workerPool.size()) {
+		int last = min(pathSize, first + workerPool.size());
+		vector<int> needed;
+		for (int e = first; e < last; e++) {
+			for (int i : job->compositeImagePath[e].path) {
+				if (greys[i].empty() && find(needed.begin(), needed.end(), i) == needed.end()) {
+					needed.push_back(i);
+				}
+			}
+		}
+		workerPool.parallelFor(int(needed.size()), [&](int k) {
+			ensurePixels(needed[k]);
+			cvtColor(job->imageSet[needed[k]].img, greys[needed[k]], COLOR_BGR2GRAY);
+			if (LAZY_IMAGE_PIXELS) {
+				job->imageSet[needed[k]].releasePixels();
+			}
+		});
+		workerPool.parallelFor(last - first, [&](int k) {
+			int parent = job->compositeImagePath[first + k].path[0], child = job->compositeImagePath[first + k].path[1];
+			Mat homo = refineEdgeHomography(parent, child, edgeHomos[first + k], greys[parent], greys[child]);
+			if (!homo.empty()) {
+				edgeHomos[first + k] = homo;
+				refined++;
+			}
+		});
+		for (int e = first; e < last; e++) {
+			for (int i : job->compositeImagePath[e].path) {
+				if (--edgesLeft[i] == 0) {
+					greys[i].release();
+				}
+			}
+		}
+	}
+
+	//parents come before their children on the path
+	job->imageSet[centerimgIndex].referenceTransform = Mat::eye(3, 3, CV_64F);
+	for (int e = 0; e < job->compositeImagePath.size(); e++) {
+		int parent = job->compositeImagePath[e].path[0], child = job->compositeImagePath[e].path[1];
+		job->imageSet[child].referenceTransform = job->imageSet[parent].referenceTransform * edgeHomos[e];
+	}
+	if (PRINT_CONSOLE_DEBUG) {
+		job->log << "Refined " << refined << " of " << job->compositeImagePath.size() << " assembly edges at scale " << job->compositeScale << endl;
+	}
+}
+
+// Corrects lifted (child onto parent at the composite scale) from the edge's best inlier matches. Each one
+// gets a patch cut around it in the child and searched for in the parent near where lifted maps it, the search
+// radius covering a couple of matching level pixels, in the images' composite scale grey levels. Empty if
+// too few points could be re-located.
+Mat refineEdgeHomography(int parent, int child, const Mat& lifted, const Mat& parentGrey, const Mat& childGrey) {
+	TRACE_SPAN("refineEdgeHomography");
+	TRACE_ARG("parent", parent);
+	TRACE_ARG("child", child);
+	int e = job->matchGraph.findEdge(parent, child);
+	if (e < 0) {
+		return Mat();
+	}
+	const MatchGraph::Edge& edge = job->matchGraph.edge(e);
+	const MatchGraph::KeypointPair* pairs = job->matchGraph.edgeMatches(e);
+	subImage& parentImage = job->imageSet[parent];
+	subImage& childImage = job->imageSet[child];
+	Mat childToMatching = childImage.levelTransform;
+	Mat parentToMatching = parentImage.levelTransform;
+	Mat matchingToChild = childToMatching.inv();
+
+	//match positions in composite scale coordinates, best ranked first
+	vector<Point2d> childPoints, parentPoints;
+	for (int m = 0; m < edge.matchCount; m++) {
+		bool parentIsImg1 = edge.img1indx == parent;
+		const KeyPoint& parentKey = parentImage.keypoints[parentIsImg1 ? pairs[m].query : pairs[m].train];
+		const KeyPoint& childKey = childImage.keypoints[parentIsImg1 ? pairs[m].train : pairs[m].query];
+		vector<Point2d> point = { Point2d(childKey.pt) };
+		perspectiveTransform(point, point, matchingToChild);
+		childPoints.push_back(point[0]);
+		parentPoints.push_back(Point2d(parentKey.pt));
+	}
+	//only matches the lifted homography agrees with are worth re-locating
+	vector<Point2d> parentLifted;
+	perspectiveTransform(childPoints, parentLifted, lifted);
+	vector<Point2d> parentMatching;
+	perspectiveTransform(parentLifted, parentMatching, parentToMatching);
+
+	int half = REFINE_PATCH_SIZE / 2;
+	int radius = int(ceil(2 * job->compositeScale / job->loadScale)) + 2;
+
+	vector<pair<double, int>> located; // correlation, match
+	vector<Point2d> refinedParent(edge.matchCount);
+	for (int m = 0; m < edge.matchCount && located.size() < REFINE_POINTS; m++) {
+		Point2d offset = parentMatching[m] - parentPoints[m];
+		if (offset.dot(offset) > HOMOGRAPHY_THRESHOLD * HOMOGRAPHY_THRESHOLD) {
+			continue;
+		}
+		Point childCenter(cvRound(childPoints[m].x), cvRound(childPoints[m].y));
+		Point predicted(cvRound(parentLifted[m].x), cvRound(parentLifted[m].y));
+		Rect patchRect(childCenter.x - half, childCenter.y - half, REFINE_PATCH_SIZE, REFINE_PATCH_SIZE);
+		Rect searchRect(predicted.x - half - radius, predicted.y - half - radius, REFINE_PATCH_SIZE + 2 * radius, REFINE_PATCH_SIZE + 2 * radius);
+		if ((patchRect & Rect(0, 0, childGrey.cols, childGrey.rows)) != patchRect
+			|| (searchRect & Rect(0, 0, parentGrey.cols, parentGrey.rows)) != searchRect) {
+			continue;
+		}
+		Mat correlation;
+		matchTemplate(parentGrey(searchRect), childGrey(patchRect), correlation, TM_CCOEFF_NORMED);
+		double peak;
+		Point peakAt;
+		minMaxLoc(correlation, nullptr, &peak, nullptr, &peakAt);
+		if (peak < REFINE_MIN_CORRELATION) {
+			continue;
+		}
+		//parabola through the peak and its neighbours for sub-pixel position
+		Point2d subpixel(peakAt);
+		if (peakAt.x > 0 && peakAt.x < correlation.cols - 1) {
+			float l = correlation.at<float>(peakAt.y, peakAt.x - 1), c = correlation.at<float>(peakAt), r = correlation.at<float>(peakAt.y, peakAt.x + 1);
+			subpixel.x += (l - r) / (2 * (l - 2 * c + r) - 1e-9);
+		}
+		if (peakAt.y > 0 && peakAt.y < correlation.rows - 1) {
+			float u = correlation.at<float>(peakAt.y - 1, peakAt.x), c = correlation.at<float>(peakAt), d = correlation.at<float>(peakAt.y + 1, peakAt.x);
+			subpixel.y += (u - d) / (2 * (u - 2 * c + d) - 1e-9);
+		}
+		//patch centre in the parent, carried back to the match position the same way it was rounded
+		refinedParent[m] = Point2d(searchRect.x + half, searchRect.y + half) + subpixel + (childPoints[m] - Point2d(childCenter));
+		located.push_back(make_pair(peak, m));
+	}
+	if (located.size() < REFINE_MIN_POINTS) {
+		return Mat();
+	}
+
+	//strongest correlations first for the solver
+	sort(located.begin(), located.end(), [](const pair<double, int>& a, const pair<double, int>& b) { return a.first > b.first; });
+	vector<Point2d> src, dst;
+	for (pair<double, int>& point : located) {
+		src.push_back(childPoints[point.second]);
+		dst.push_back(refinedParent[point.second]);
+	}
+	vector<uchar> inliers;
+	int iterations;
+	Mat homo = prosacHomography(src, dst, inliers, iterations);
+	if (homo.empty() || count(inliers.begin(), inliers.end(), 1) < REFINE_MIN_POINTS) {
+		return Mat();
+	}
+	return homo;
+}
+
+// Bounding box of every planned image on the composite surface, the center image's plane or a
+// cylinder or sphere around the camera (PROJECTION). Images whose transform is degenerate (behind
+// the camera or absurdly large) are dropped from imagesInComposite.
+Rect planCanvas(int centerimgIndex) {
+	Rect canvas;
+	vector<int> kept;
+	int maxSide = int(MAX_CANVAS_SIDE * job->pixelScale / job->loadScale); // MAX_CANVAS_SIDE is at the matching scale
+	if (PROJECTION != 0) {
+		//the curved surface is centred on the center image's principal point
+		Rect center = job->imageSet[centerimgIndex].contentRect;
+		job->projectionCenter = Point2d(center.x + center.width / 2.0, center.y + center.height / 2.0);
+		job->projectionFocal = estimateFocalLength(centerimgIndex);
+	}
+	for (int i : job->imagesInComposite) {
+		Rect bounds;
+		bool valid = imageBounds(i, bounds);
+		if (i != centerimgIndex && (!valid || bounds.width > maxSide || bounds.height > maxSide)) {
+			job->log << "Leaving out img " << i << ", its transform is degenerate" << endl;
+			continue;
+		}
+		canvas = kept.empty() ? bounds : (canvas | bounds);
+		kept.push_back(i);
+	}
+	job->imagesInComposite = kept;
+	//keep the canvas within MAX_CANVAS_SIDE around the center image
+	Rect center;
+	imageBounds(centerimgIndex, center);
+	Rect limit(center.x + center.width / 2 - maxSide / 2, center.y + center.height / 2 - maxSide / 2, maxSide, maxSide);
+	return canvas & limit;
+}
+
+// Focal length shared by the set, in composite pixels, as the median of the ones the assembly edges'
+// homographies imply if they were pure rotations. Falls back to the camera model's.
+double estimateFocalLength(int centerimgIndex) {
+	vector<double> focals;
+	for (PathNode& node : job->compositeImagePath) {
+		subImage& parent = job->imageSet[node.path[0]];
+		subImage& child = job->imageSet[node.path[1]];
+		//child onto parent, with both principal points moved to the origin
+		Rect p = parent.contentRect, c = child.contentRect;
+		Mat toParent = (Mat_<double>(3, 3) << 1, 0, -(p.x + p.width / 2.0), 0, 1, -(p.y + p.height / 2.0), 0, 0, 1);
+		Mat fromChild = (Mat_<double>(3, 3) << 1, 0, c.x + c.width / 2.0, 0, 1, c.y + c.height / 2.0, 0, 0, 1);
+		Mat homo = toParent * parent.referenceTransform.inv() * child.referenceTransform * fromChild;
+		double f0, f1;
+		bool f0ok, f1ok;
+		detail::focalsFromHomography(homo, f0, f1, f0ok, f1ok);
+		if (f0ok && f1ok) {
+			focals.push_back(sqrt(f0 * f1));
+		}
+	}
+	Rect center = job->imageSet[centerimgIndex].contentRect;
+	double focal = cameraModel.intrinsicFor(center.size(), job->pixelScale / job->loadScale).at<double>(0, 0);
+	if (!focals.empty()) {
+		nth_element(focals.begin(), focals.begin() + focals.size() / 2, focals.end());
+		focal = focals[focals.size() / 2];
+	}
+	if (PRINT_CAMERA_DEBUG) {
+		job->log << "Projection focal length " << focal << " px from " << focals.size() << " of " << job->compositeImagePath.size() << " assembly edges" << endl;
+	}
+	return focal;
+}
+
+// Ray in the center camera's frame through pixel (x, y) of an image, given the image's transform into the center image
+static inline Point3d centerRay(const Mat_<double>& toCenter, double x, double y) {
+	double cx = toCenter(0, 0) * x + toCenter(0, 1) * y + toCenter(0, 2);
+	double cy = toCenter(1, 0) * x + toCenter(1, 1) * y + toCenter(1, 2);
+	double w = toCenter(2, 0) * x + toCenter(2, 1) * y + toCenter(2, 2);
+	return Point3d((cx - job->projectionCenter.x * w) / job->projectionFocal, (cy - job->projectionCenter.y * w) / job->projectionFocal, w);
+}
+
+// Image bounds on the composite surface. Curved surfaces are in angle times focal length, so an
+// image's extent follows the field of view it covers rather than how far its plane is tilted.
+// Returns false if the image can't be placed there.
+bool imageBounds(int imgindx, Rect& bounds) {
+	subImage& image = job->imageSet[imgindx];
+	if (PROJECTION == 0) {
+		return projectedBounds(image.referenceTransform, image.contentRect, bounds);
+	}
+	//a homography is only known up to scale, this sign keeps rays pointing out of the camera
+	Mat_<double> toCenter = Mat(image.referenceTransform * (determinant(image.referenceTransform) < 0 ? -1.0 : 1.0));
+	Rect source = image.contentRect;
+	double minX = DBL_MAX, minY = DBL_MAX, maxX = -DBL_MAX, maxY = -DBL_MAX;
+	for (int side = 0; side < 4; side++) {
+		for (int k = 0; k <= PROJECTION_EDGE_SAMPLES; k++) {
+			double t = double(k) / PROJECTION_EDGE_SAMPLES;
+			double x = source.x + (side < 2 ? t * source.width : (side == 2 ? 0 : source.width));
+			double y = source.y + (side < 2 ? (side == 0 ? 0 : source.height) : t * source.height);
+			Point3d ray = centerRay(toCenter, x, y);
+			double radial = sqrt(ray.x * ray.x + ray.z * ray.z);
+			if (radial < 1e-9) {
+				return false; // straight up or down, off the cylinder
+			}
+			double u = job->projectionFocal * atan2(ray.x, ray.z);
+			double v = job->projectionFocal * (PROJECTION == 1 ? ray.y / radial : atan2(ray.y, radial));
+			minX = min(minX, u); maxX = max(maxX, u);
+			minY = min(minY, v); maxY = max(maxY, v);
+		}
+	}
+	bounds = Rect(Point(int(floor(minX)) - 1, int(floor(minY)) - 1), Point(int(ceil(maxX)) + 2, int(ceil(maxY)) + 2));
+	image.projectedRect = bounds;
+	return true;
+}
+
+// Builds the remap tables from an image's projectedRect back onto its pixels, once per image until its
+// pixels are released. Rows are filled in parallel in floating point and stored as OpenCV's fixed-point
+// maps, which remap reads faster and in a third of the memory.
+void ensureProjectionMap(int imgindx) {
+	static mutex mapLocks[16];
+	lock_guard<mutex> guard(mapLocks[imgindx % 16]);
+	subImage& image = job->imageSet[imgindx];
+	if (!image.projectionMap1.empty()) {
+		return;
+	}
+	Rect area = image.projectedRect;
+	Mat_<double> toCenter = Mat(image.referenceTransform * (determinant(image.referenceTransform) < 0 ? -1.0 : 1.0));
+	//surface ray to image pixel: back through the center camera, then out of this image's
+	Mat fromRay = (Mat_<double>(3, 3) << job->projectionFocal, 0, job->projectionCenter.x, 0, job->projectionFocal, job->projectionCenter.y, 0, 0, 1);
+	Mat_<double> m = Mat(toCenter.inv() * fromRay);
+	//the angle around the axis only depends on the column
+	vector<double> sinU(area.width), cosU(area.width);
+	for (int c = 0; c < area.width; c++) {
+		double angle = (area.x + c) / job->projectionFocal;
+		sinU[c] = sin(angle);
+		cosU[c] = cos(angle);
+	}
+	image.projectionMap1.create(area.height, area.width, CV_16SC2);
+	image.projectionMap2.create(area.height, area.width, CV_16UC1);
+	workerPool.parallelForRows(area.height, BLEND_ROWS_PER_TASK, [&](int rowStart, int rowEnd) {
+		Mat mapX(rowEnd - rowStart, area.width, CV_32F), mapY(rowEnd - rowStart, area.width, CV_32F);
+		for (int r = rowStart; r < rowEnd; r++) {
+			double v = (area.y + r) / job->projectionFocal;
+			//cylinder: height along the axis, sphere: elevation angle
+			double height = PROJECTION == 1 ? v : tan(v);
+			float* xs = mapX.ptr<float>(r - rowStart);
+			float* ys = mapY.ptr<float>(r - rowStart);
+			for (int c = 0; c < area.width; c++) {
+				double rx = sinU[c], ry = height, rz = cosU[c];
+				double w = m(2, 0) * rx + m(2, 1) * ry + m(2, 2) * rz;
+				if (w <= 1e-9) {
+					xs[c] = ys[c] = -1; // behind this image's camera
+					continue;
+				}
+				xs[c] = float((m(0, 0) * rx + m(0, 1) * ry + m(0, 2) * rz) / w);
+				ys[c] = float((m(1, 0) * rx + m(1, 1) * ry + m(1, 2) * rz) / w);
+			}
+		}
+		Mat map1 = image.projectionMap1.rowRange(rowStart, rowEnd);
+		Mat map2 = image.projectionMap2.rowRange(rowStart, rowEnd);
+		convertMaps(mapX, mapY, map1, map2, CV_16SC2);
+	});
+}
+
+// Warps image imgindx onto the part of the composite surface starting at origin (the surface point of
+// the canvas' top left pixel) and size canvas. Planar composites warp through the image's homography,
+// curved ones remap through its projection table. roi says where the result goes, empty if nowhere.
+// weighted is the image's weightedImage if the caller keeps it between calls, built here if empty.
+Mat warpToCanvas(int imgindx, Point origin, Size canvas, Rect& roi, const Mat& weighted) {
+	if (PROJECTION == 0) {
+		Mat homo = (Mat_<double>(3, 3) << 1, 0, -origin.x, 0, 1, -origin.y, 0, 0, 1) * job->imageSet[imgindx].referenceTransform;
+		return warpImage(imgindx, homo, canvas, roi, weighted);
+	}
+	subImage& image = job->imageSet[imgindx];
+	roi = (image.projectedRect - origin) & Rect(0, 0, canvas.width, canvas.height);
+	if (roi.empty()) {
+		return Mat();
+	}
+	Mat source = weighted.empty() ? weightedImage(imgindx) : weighted;
+	ensureProjectionMap(imgindx);
+	Rect mapRect = roi + origin - image.projectedRect.tl();
+	Mat warpedImg = job->scratch->acquire(roi.height, roi.width, source.type());
+	remap(source, warpedImg, image.projectionMap1(mapRect), image.projectionMap2(mapRect), INTER_LINEAR, BORDER_CONSTANT);
+	return warpedImg;
+}
 
+// Warps image imgindx onto the composite, whose top left pixel is the surface point origin, and adds its
+// weighted colour to the accumulator. Several images can be added at once, bandLocks guard the rows.
+void composite2Images(Mat& accumulator, vector<mutex>& bandLocks, int imgindx, Point origin, const Mat& weighted) {
+	TRACE_SPAN("composite2Images");
 	//apply transformation to image 
-	Mat warpedImg = Mat(img_2.rows, img_2.cols, img_2.type());
-	warpPerspective(img_2, warpedImg, homo, warpedImg.size());
-
-	if (IMAGE_MATCHING_DEBUG) {
-		namedWindow("warpedIMG", WINDOW_NORMAL);
-		imshow("warpedIMG", warpedImg);
-		resizeWindow("warpedIMG", 800, 800);
-	}
-
-	//compose images
-	Mat compositeImg;
-
-	compositeImg = smartAddImg(img_1, warpedImg);
-	//addWeighted(img_1, 0.5, warpedImg, 0.5, 1, compositeImg);
-	//display
-	string window = "composite Img using transform " + to_string(img2indx) + " to " + to_string(img1indx);
-	namedWindow(window, WINDOW_NORMAL);
-	imshow(window, compositeImg);
-	resizeWindow(window, 800, 800);
-
-	return compositeImg;
-}
-
-Mat smartAddImg(Mat& img_1, Mat& img_2) {
-	//solid mask
-	Mat solidMask = Mat::zeros(img_2.rows, img_2.cols, CV_8U);
-	Mat erodedMask = Mat::zeros(img_2.rows, img_2.cols, CV_8U);
-	for (int r = 0; r < img_2.rows; r++) {
-		for (int c = 0; c < img_2.cols; c++) {
-			if (img_2.at<Vec3b>(r, c) != Vec3b(0, 0, 0)) {
-				solidMask.at<unsigned char>(r, c) = 255;
-			}
-		}
-	}
-	//erode it a bit (gets rid of fine black outline)
-	int erosion_size = 10;
-	Mat element = getStructuringElement(MORPH_RECT,
-		Size(2 * erosion_size + 1, 2 * erosion_size + 1),
-		Point(erosion_size, erosion_size));
-	erode(solidMask, solidMask, element);
-	//erode again so blur is smother transition, ei edges of blur dont start at grey and not black
-	erosion_size = SMART_ADD_GAUSIAN_BLUR;
-	element = getStructuringElement(MORPH_RECT,
-		Size(2 * erosion_size + 1, 2 * erosion_size + 1),
-		Point(erosion_size, erosion_size));
-	erode(solidMask, erodedMask, element);
-
-
-	//diplay if debug flag
-	if (IMAGE_SMART_ADD_DEBUG) {
-		namedWindow("solidMask", WINDOW_NORMAL);
-		imshow("solidMask", solidMask);
-		resizeWindow("solidMask", 600, 600);
-	}
-	//Blur the mask for use in blending, wraped this in a try cause blurs can be finicky  
-	Mat bluredMask = Mat(img_2.rows, img_2.cols, CV_8U);
-	try {
-		GaussianBlur(erodedMask, bluredMask, Size(SMART_ADD_GAUSIAN_BLUR, SMART_ADD_GAUSIAN_BLUR), 0, 0);
-		if (IMAGE_SMART_ADD_DEBUG) {
-			namedWindow("bluredMask", WINDOW_NORMAL);
-			imshow("bluredMask", bluredMask);
-			resizeWindow("bluredMask", 600, 600);
+	Rect roi;
+	Mat warpedImg = warpToCanvas(imgindx, origin, accumulator.size(), roi, weighted);
+	TRACE_ARG("img", imgindx);
+	TRACE_ARG("width", roi.width);
+	TRACE_ARG("height", roi.height);
+	if (roi.empty()) {
+		return;
+	}
+	accumulateImage(accumulator, warpedImg, roi, &bandLocks);
+}
+
+// Composites the images in the composite onto canvas, a BGRA Mat of its size. The accumulator costs 16 bytes
+// a pixel, so it only covers as many full-width rows as fit in ACCUMULATOR_MAX_BYTES: the canvas is done in
+// bands of that height, each band's images warped concurrently into it and the band normalised into its rows
+// of composite. Canvases that fit take a single band. An image's weightedImage is built by the first band it
+// reaches and kept until the bands pass its bottom edge, so each band only warps its own rows of the images
+// and no image is merged twice. With LAZY_IMAGE_PIXELS its pixels are released then too. weightSum, if given,
+// gets each pixel's summed blend weight (CV_32S).
+void renderComposite(Rect canvas, Mat& composite, Mat* weightSum) {
+	composite.create(canvas.height, canvas.width, CV_8UC4);
+	if (weightSum) {
+		weightSum->create(canvas.height, canvas.width, CV_32S);
+	}
+	vector<Rect> bounds;
+	for (int i : job->imagesInComposite) {
+		Rect imageRect;
+		imageBounds(i, imageRect);
+		bounds.push_back((imageRect - canvas.tl()) & Rect(0, 0, canvas.width, canvas.height));
+	}
+	size_t rowBytes = size_t(max(1, canvas.width)) * 4 * sizeof(int);
+	int bandRows = int(max(size_t(1), min(size_t(canvas.height), size_t(ACCUMULATOR_MAX_BYTES) / rowBytes)));
+	vector<Mat> weighted(job->imagesInComposite.size());
+	vector<bool> released(job->imagesInComposite.size(), false);
+	for (int bandStart = 0; bandStart < canvas.height; bandStart += bandRows) {
+		Rect band(0, bandStart, canvas.width, min(bandRows, canvas.height - bandStart));
+		Mat accumulator = job->scratch->acquire(band.height, band.width, CV_32SC4, true);
+		vector<mutex> bandLocks((band.height + BLEND_ROWS_PER_TASK - 1) / BLEND_ROWS_PER_TASK);
+		workerPool.parallelFor(int(job->imagesInComposite.size()), [&](int k) {
+			if (!(bounds[k] & band).empty()) {
+				if (weighted[k].empty()) {
+					weighted[k] = weightedImage(job->imagesInComposite[k]);
+				}
+				composite2Images(accumulator, bandLocks, job->imagesInComposite[k], canvas.tl() + band.tl(), weighted[k]);
+			}
+		});
+		Mat rows = composite.rowRange(band.y, band.br().y);
+		normalizeAccumulator(accumulator, rows);
+		if (weightSum) {
+			Mat weightRows = weightSum->rowRange(band.y, band.br().y);
+			extractChannel(accumulator, weightRows, 3);
 		}
+		for (int k = 0; k < job->imagesInComposite.size(); k++) {
+			if (!released[k] && bounds[k].br().y <= band.br().y) {
+				weighted[k].release();
+				if (LAZY_IMAGE_PIXELS) {
+					job->imageSet[job->imagesInComposite[k]].releasePixels();
+				}
+				released[k] = true;
+			}
+		}
+	}
+}
+
+// Warps image imgindx through homo (image -> canvas) into a BGRA buffer with its feather weights as
+// alpha. Only the part of the canvas the image lands on is warped, roi says where that is (empty if
+// the image misses the canvas). weighted is as for warpToCanvas. Safe to call from worker threads.
+Mat warpImage(int imgindx, Mat& homo, Size canvas, Rect& roi, const Mat& weighted) {
+	roi = warpedBounds(homo, job->imageSet[imgindx].contentRect, canvas);
+	if (roi.empty()) {
+		return Mat();
+	}
+	//source pixels with their feather weight as alpha, so a single warp moves both
+	Mat img_2 = weighted.empty() ? weightedImage(imgindx) : weighted;
+	Mat roiHomo = (Mat_<double>(3, 3) << 1, 0, -roi.x, 0, 1, -roi.y, 0, 0, 1) * homo;
+	Mat warpedImg = job->scratch->acquire(roi.height, roi.width, img_2.type());
+	warpPerspective(img_2, warpedImg, roiHomo, warpedImg.size());
+	return warpedImg;
+}
+
+// Renders the composite as OUTPUT_TILE_SIZE tiles and writes each one out as soon as it is done, so the
+// canvas never exists in memory. Tiles go one row at a time, the row's tiles in parallel on the worker
+// pool, and with LAZY_IMAGE_PIXELS an image's pixels are released once the rows pass its bottom edge, so
+// only the images overlapping the current row of tiles are loaded. Only tiles some image overlaps are
+// rendered. folder gets one PNG per tile plus index.json describing the canvas and where every tile goes.
+bool renderTiledComposite(Rect canvas, string folder) {
+	try {
+		filesystem::create_directories(folder);
 	}
 	catch (const std::exception & e) {
-		cout << "Blur error, somethign is wrong" << endl;
-		cout << e.what() << endl;
-		//bluredMask = solidMask;
-	}
-	//actually compute the new image on top of image 1 
-	for (int r = 0; r < img_2.rows; r++) {
-		for (int c = 0; c < img_2.cols; c++) {
-			if (solidMask.at<unsigned char>(r, c) == 255) {
-				Vec3b img2Pixel = img_2.at<Vec3b>(r, c);
-				Vec3b img1Pixel = img_1.at<Vec3b>(r, c);
-				if (img1Pixel != Vec3b(0, 0, 0)) {
-					unsigned char mix = bluredMask.at<unsigned char>(r, c);
-					img_1.at<Vec3b>(r, c) = (img1Pixel * double(double(255 - mix) / double(255))) + (img2Pixel * double(double(mix) / double(255)));
+		job->log << e.what() << endl;
+		return false;
+	}
+
+	//canvas bounds of every image, computed once for all tiles
+	vector<Rect> bounds;
+	for (int i : job->imagesInComposite) {
+		Rect imageRect;
+		imageBounds(i, imageRect);
+		bounds.push_back((imageRect - canvas.tl()) & Rect(0, 0, canvas.width, canvas.height));
+	}
+
+	int tileCols = (canvas.width + OUTPUT_TILE_SIZE - 1) / OUTPUT_TILE_SIZE;
+	int tileRows = (canvas.height + OUTPUT_TILE_SIZE - 1) / OUTPUT_TILE_SIZE;
+	vector<string> tileFiles(tileCols * tileRows);
+	vector<Mat> weighted(job->imagesInComposite.size()); // weightedImage of the images the current row overlaps
+	atomic<bool> failed{ false };
+
+	auto renderTile = [&](int t) {
+		Rect tileRect(t % tileCols * OUTPUT_TILE_SIZE, t / tileCols * OUTPUT_TILE_SIZE, OUTPUT_TILE_SIZE, OUTPUT_TILE_SIZE);
+		tileRect &= Rect(0, 0, canvas.width, canvas.height);
+		TRACE_SPAN("renderTile");
+		TRACE_ARG("row", t / tileCols);
+		TRACE_ARG("col", t % tileCols);
+		Mat accumulator;
+		//the same sums as the in-memory composite, so tiles match it exactly
+		for (int k = 0; k < job->imagesInComposite.size(); k++) {
+			if ((bounds[k] & tileRect).empty()) {
+				continue;
+			}
+			if (accumulator.empty()) {
+				accumulator = job->scratch->acquire(tileRect.height, tileRect.width, CV_32SC4, true);
+			}
+			Rect roi;
+			Mat warpedImg = warpToCanvas(job->imagesInComposite[k], canvas.tl() + tileRect.tl(), accumulator.size(), roi, weighted[k]);
+			if (!roi.empty()) {
+				accumulateImage(accumulator, warpedImg, roi);
+			}
+		}
+		if (accumulator.empty()) {
+			return; // nothing lands here, no file
+		}
+		Mat tile = job->scratch->acquire(tileRect.height, tileRect.width, CV_8UC4);
+		normalizeAccumulator(accumulator, tile);
+		string file = "tile_" + to_string(t / tileCols) + "_" + to_string(t % tileCols) + ".png";
+		if (!saveResult(tile, folder + "/" + file)) {
+			failed = true;
+			return; // left out of the index
+		}
+		tileFiles[t] = file;
+	};
+
+	//each row finishes before the next starts, so images that end above the next row are done with. An
+	//image's weightedImage is built when the rows reach it, once for every tile it is in
+	vector<bool> released(job->imagesInComposite.size(), false);
+	for (int row = 0; row < tileRows; row++) {
+		int rowEnd = min(canvas.height, (row + 1) * OUTPUT_TILE_SIZE);
+		Rect rowRect(0, row * OUTPUT_TILE_SIZE, canvas.width, rowEnd - row * OUTPUT_TILE_SIZE);
+		workerPool.parallelFor(int(job->imagesInComposite.size()), [&](int k) {
+			if (weighted[k].empty() && !(bounds[k] & rowRect).empty()) {
+				weighted[k] = weightedImage(job->imagesInComposite[k]);
+			}
+		});
+		workerPool.parallelFor(tileCols, [&](int col) {
+			renderTile(row * tileCols + col);
+		});
+		for (int k = 0; k < job->imagesInComposite.size(); k++) {
+			if (!released[k] && bounds[k].br().y <= rowEnd) {
+				weighted[k].release();
+				if (LAZY_IMAGE_PIXELS) {
+					job->imageSet[job->imagesInComposite[k]].releasePixels();
+				}
+				released[k] = true;
+			}
+		}
+	}
+
+	ofstream index(folder + "/index.json");
+	index << "{\n  \"width\": " << canvas.width << ",\n  \"height\": " << canvas.height
+		<< ",\n  \"tileSize\": " << OUTPUT_TILE_SIZE << ",\n  \"tiles\": [";
+	bool first = true;
+	for (int t = 0; t < tileFiles.size(); t++) {
+		if (tileFiles[t].empty()) {
+			continue;
+		}
+		Rect tileRect(t % tileCols * OUTPUT_TILE_SIZE, t / tileCols * OUTPUT_TILE_SIZE, OUTPUT_TILE_SIZE, OUTPUT_TILE_SIZE);
+		tileRect &= Rect(0, 0, canvas.width, canvas.height);
+		index << (first ? "\n" : ",\n") << "    { \"row\": " << t / tileCols << ", \"col\": " << t % tileCols
+			<< ", \"x\": " << tileRect.x << ", \"y\": " << tileRect.y << ", \"width\": " << tileRect.width
+			<< ", \"height\": " << tileRect.height << ", \"file\": \"" << tileFiles[t] << "\" }";
+		first = false;
+	}
+	index << "\n  ]\n}\n";
+	index.close();
+	if (!index.good()) {
+		job->log << "Problem writing " << folder << "/index.json" << endl;
+		return false;
+	}
+	if (PRINT_CONSOLE_DEBUG) {
+		job->log << "Wrote " << tileCols * tileRows << " tile grid (" << canvas.width << " x " << canvas.height << ") to " << folder << endl;
+	}
+	return !failed;
+}
+
+// Rectangle covered by source warped through homo, padded a pixel for interpolation. Returns false
+// if a corner lands behind the camera, where the projection has no finite bounds.
+bool projectedBounds(const Mat& homo, Rect source, Rect& bounds) {
+	Mat_<double> h;
+	homo.convertTo(h, CV_64F);
+	double corners[4][2] = { { double(source.x), double(source.y) }, { double(source.x + source.width), double(source.y) },
+		{ double(source.x), double(source.y + source.height) }, { double(source.x + source.width), double(source.y + source.height) } };
+	double minX = DBL_MAX, minY = DBL_MAX, maxX = -DBL_MAX, maxY = -DBL_MAX;
+	for (int i = 0; i < 4; i++) {
+		double x = corners[i][0], y = corners[i][1];
+		double w = h(2, 0) * x + h(2, 1) * y + h(2, 2);
+		if (w <= 1e-9) {
+			return false;
+		}
+		double u = (h(0, 0) * x + h(0, 1) * y + h(0, 2)) / w;
+		double v = (h(1, 0) * x + h(1, 1) * y + h(1, 2)) / w;
+		minX = min(minX, u); maxX = max(maxX, u);
+		minY = min(minY, v); maxY = max(maxY, v);
+	}
+	//clamp before converting so wild homographies can't overflow int
+	const double limit = 1e8;
+	minX = max(minX, -limit); minY = max(minY, -limit);
+	maxX = min(maxX, limit); maxY = min(maxY, limit);
+	bounds = Rect(Point(int(floor(minX)) - 1, int(floor(minY)) - 1), Point(int(ceil(maxX)) + 2, int(ceil(maxY)) + 2));
+	return true;
+}
+
+// Canvas rectangle covered by source warped through homo, clipped to the canvas. Falls back to the
+// whole canvas if a corner lands behind the camera.
+Rect warpedBounds(const Mat& homo, Rect source, Size canvas) {
+	Rect canvasRect(0, 0, canvas.width, canvas.height);
+	if (homo.empty()) {
+		return Rect();
+	}
+	Rect bounds;
+	if (!projectedBounds(homo, source, bounds)) {
+		return canvasRect;
+	}
+	return bounds & canvasRect;
+}
+
+// BGRA copy of an image with its feather weights as the alpha channel, in a scratch buffer
+Mat weightedImage(int imgindx) {
+	ensurePixels(imgindx);
+	subImage& image = job->imageSet[imgindx];
+	Mat weighted = job->scratch->acquire(image.img.rows, image.img.cols, CV_8UC(image.img.channels() + 1));
+	vector<Mat> channels = { image.img, image.weights };
+	merge(channels, weighted);
+	return weighted;
+}
+
+// Adds warped (BGRA, alpha = feather weight) into the accumulator (CV_32SC4) at roi: colour times weight
+// into the first three channels, the weight into the fourth. Integer sums don't depend on the order
+// images are added in. With bandLocks, each BLEND_ROWS_PER_TASK rows of the accumulator are added to
+// under their own lock so images can be added from several threads.
+void accumulateImage(Mat& accumulator, const Mat& warped, Rect roi, vector<mutex>* bandLocks) {
+	TRACE_SPAN("accumulateImage");
+	TRACE_ARG("width", roi.width);
+	TRACE_ARG("height", roi.height);
+	int row = 0;
+	while (row < warped.rows) {
+		int band = (roi.y + row) / BLEND_ROWS_PER_TASK;
+		int bandEnd = min(warped.rows, (band + 1) * BLEND_ROWS_PER_TASK - roi.y);
+		unique_lock<mutex> guard;
+		if (bandLocks) {
+			guard = unique_lock<mutex>((*bandLocks)[band]);
+		}
+		for (; row < bandEnd; row++) {
+			int* sums = accumulator.ptr<int>(roi.y + row) + roi.x * 4;
+			const uchar* src = warped.ptr<uchar>(row);
+			for (int c = 0; c < warped.cols * 4; c += 4) {
+				int w = src[c + 3];
+				sums[c] += src[c] * w;
+				sums[c + 1] += src[c + 1] * w;
+				sums[c + 2] += src[c + 2] * w;
+				sums[c + 3] += w;
+			}
+		}
+	}
+}
+
+// Weighted mean colour per pixel of an accumulator, as BGRA with alpha = coverage. Rows are split
+// across the worker pool.
+void normalizeAccumulator(const Mat& accumulator, Mat& composite) {
+	composite.create(accumulator.rows, accumulator.cols, CV_8UC4);
+	workerPool.parallelForRows(accumulator.rows, BLEND_ROWS_PER_TASK, [&](int rowStart, int rowEnd) {
+		for (int r = rowStart; r < rowEnd; r++) {
+			const int* sums = accumulator.ptr<int>(r);
+			uchar* dst = composite.ptr<uchar>(r);
+			for (int c = 0; c < accumulator.cols * 4; c += 4) {
+				int w = sums[c + 3];
+				if (w == 0) {
+					dst[c] = dst[c + 1] = dst[c + 2] = dst[c + 3] = 0;
+					continue;
+				}
+				dst[c] = uchar((sums[c] + w / 2) / w);
+				dst[c + 1] = uchar((sums[c + 1] + w / 2) / w);
+				dst[c + 2] = uchar((sums[c + 2] + w / 2) / w);
+				dst[c + 3] = 255;
+			}
+		}
+	});
+}
+
+// dst = (dst * (255 - w) + src * w) / 255 per byte, rounded, for 8-bit weights
+static void blendRow(uchar* dst, const uchar* src, const uchar* weights, int bytes) {
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i full = _mm256_set1_epi16(255);
+	const __m256i half = _mm256_set1_epi16(128);
+	for (; i + 16 <= bytes; i += 16) {
+		__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(dst + i)));
+		__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i)));
+		__m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(weights + i)));
+		__m256i v = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_sub_epi16(full, w)), _mm256_mullo_epi16(b, w)), half);
+		v = _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8); // exact v / 255 for 16 bit v
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+	}
+#endif
+	for (; i < bytes; i++) {
+		int v = dst[i] * (255 - weights[i]) + src[i] * weights[i] + 128;
+		dst[i] = uchar((v + (v >> 8)) >> 8);
+	}
+}
+
+// Blends warped (BGRA, alpha = feather weight) over composite (BGRA, alpha = coverage) in place.
+// Where the composite has no coverage yet the warped pixel is copied, elsewhere it is mixed in by its
+// weight, and everything the warped image covers ends up covered. Rows are split across the worker
+// pool and blended in 16-bit fixed point.
+void blendImages(Mat& composite, const Mat& warped) {
+	workerPool.parallelForRows(warped.rows, BLEND_ROWS_PER_TASK, [&](int rowStart, int rowEnd) {
+		vector<uchar> weights(warped.cols * 4);
+		for (int r = rowStart; r < rowEnd; r++) {
+			uchar* dst = composite.ptr<uchar>(r);
+			const uchar* src = warped.ptr<uchar>(r);
+			//per pixel weight of the warped image, spread over the colour channels
+			for (int c = 0; c < warped.cols; c++) {
+				uchar feather = src[c * 4 + 3];
+				uchar w = feather == 0 ? 0 : (dst[c * 4 + 3] == 0 ? 255 : feather);
+				weights[c * 4] = w;
+				weights[c * 4 + 1] = w;
+				weights[c * 4 + 2] = w;
+				weights[c * 4 + 3] = 0; // coverage is set below
+			}
+			blendRow(dst, src, weights.data(), warped.cols * 4);
+			for (int c = 0; c < warped.cols; c++) {
+				if (src[c * 4 + 3] != 0) {
+					dst[c * 4 + 3] = 255;
+				}
+			}
+		}
+	});
+}
+
+/* --------------- Streaming ----------------- */
+
+// Incremental stitching: every frame is matched only against a window of recent frames and a few
+// keyframes, chained onto the best of them, and blended straight into a panorama that grows as needed.
+// Nothing already blended is revisited. Every frame drops its pixels once blended, and a frame that is in
+// neither the window nor the keyframes is retired, its imageSet slot taken by a later frame. Memory stays
+// bounded by the window, the keyframes and the panorama, which STREAM_MAX_CANVAS_SIDE caps.
+// source is a video file, or a folder that is watched for new images (taken in name order).
+void stitchStream(string source) {
+	StreamSource frames;
+	bool fromVideo = filesystem::is_regular_file(source);
+	if (fromVideo && !frames.video.open(source)) {
+		job->log << "Could not open " << source << endl;
+		return;
+	}
+	if (!fromVideo) {
+		frames.folder = source;
+	}
+	if (PRINT_CONSOLE_DEBUG) {
+		job->log << "\n Streaming frames from " << source << " \n" << endl;
+	}
+
+	job->imageSet.clear();
+	Mat panorama; // BGRA, alpha = coverage
+	Point origin; // Reference frame coordinates of the panorama's top left pixel
+	deque<int> window; // Recent frames in the panorama, oldest first
+	deque<int> keyframes; // Oldest first
+	vector<int> retired; // imageSet slots of frames that are no longer matched against
+	int frameNumber = 0, stitched = 0, dropped = 0;
+	double totalLatency = 0, maxLatency = 0;
+	auto lastFrame = high_resolution_clock::now();
+
+	while (true) {
+		Mat frame;
+		double remainingScale = 1;
+		string name;
+		if (!nextStreamFrame(frames, frame, remainingScale, name)) {
+			if (fromVideo || duration_cast<milliseconds>(high_resolution_clock::now() - lastFrame).count() > STREAM_IDLE_TIMEOUT_MS) {
+				break;
+			}
+			this_thread::sleep_for(milliseconds(STREAM_POLL_MS));
+			continue;
+		}
+		auto arrived = high_resolution_clock::now();
+		lastFrame = arrived;
+
+		int i = int(job->imageSet.size());
+		if (retired.empty()) {
+			job->imageSet.push_back(subImage(name, frame, remainingScale));
+		}
+		else {
+			i = retired.back();
+			retired.pop_back();
+			job->imageSet[i] = subImage(name, frame, remainingScale);
+		}
+		frame.release();
+		computeFeatures(i);
+
+		//match against the window and the keyframes, best verified one wins
+		vector<int> candidates(window.begin(), window.end());
+		for (int k : keyframes) {
+			if (find(candidates.begin(), candidates.end(), k) == candidates.end()) {
+				candidates.push_back(k);
+			}
+		}
+		vector<PairMatch> matches(candidates.size());
+		workerPool.parallelFor(int(candidates.size()), [&](int c) {
+			matches[c] = FindMatches(candidates[c], i);
+			if (matches[c].matchScore < job->imageMatchingThreshold + 50) {
+				solveTransforms(matches[c]);
+			}
+		});
+		int best = -1;
+		for (int c = 0; c < matches.size(); c++) {
+			if (!matches[c].homo1.empty() && matches[c].matchScore < job->imageMatchingThreshold
+				&& (best < 0 || matches[c].matchScore < matches[best].matchScore)) {
+				best = c;
+			}
+		}
+
+		subImage& image = job->imageSet[i];
+		bool placed = false;
+		if (frameNumber == 0) {
+			image.referenceTransform = Mat::eye(3, 3, CV_64F);
+			placed = true;
+		}
+		else if (best >= 0) {
+			Mat pairHomo;
+			matches[best].homo1.convertTo(pairHomo, CV_64F);
+			image.referenceTransform = job->imageSet[candidates[best]].referenceTransform * pairHomo;
+			placed = true;
+		}
+
+		//grow the panorama to fit the frame, with slack so it doesn't reallocate every frame
+		Rect bounds;
+		if (placed && (!projectedBounds(image.referenceTransform, image.contentRect, bounds)
+			|| bounds.width > STREAM_MAX_CANVAS_SIDE || bounds.height > STREAM_MAX_CANVAS_SIDE)) {
+			placed = false;
+		}
+		if (placed) {
+			Rect current(origin, panorama.size());
+			Rect needed = panorama.empty() ? bounds : (current | bounds);
+			if (needed.width > STREAM_MAX_CANVAS_SIDE || needed.height > STREAM_MAX_CANVAS_SIDE) {
+				placed = false;
+			}
+			else if (needed != current) {
+				//slack on both sides can't take it past the cap
+				int slackX = min(needed.width / 4, (STREAM_MAX_CANVAS_SIDE - needed.width) / 2);
+				int slackY = min(needed.height / 4, (STREAM_MAX_CANVAS_SIDE - needed.height) / 2);
+				int left = needed.x < current.x ? current.x - needed.x + slackX : 0;
+				int top = needed.y < current.y ? current.y - needed.y + slackY : 0;
+				int right = needed.br().x > current.br().x ? needed.br().x - current.br().x + slackX : 0;
+				int bottom = needed.br().y > current.br().y ? needed.br().y - current.br().y + slackY : 0;
+				if (panorama.empty()) {
+					panorama = Mat::zeros(bounds.height, bounds.width, CV_8UC4);
+					origin = bounds.tl();
 				}
 				else {
-					img_1.at<Vec3b>(r, c) = img2Pixel;
+					copyMakeBorder(panorama, panorama, top, bottom, left, right, BORDER_CONSTANT, Scalar::all(0));
+					origin -= Point(left, top);
 				}
 			}
+		}
+		if (placed) {
+			Mat homo = (Mat_<double>(3, 3) << 1, 0, -origin.x, 0, 1, -origin.y, 0, 0, 1) * image.referenceTransform;
+			Rect roi;
+			Mat warpedImg = warpImage(i, homo, panorama.size(), roi);
+			if (!roi.empty()) {
+				Mat panoramaRoi = panorama(roi);
+				blendImages(panoramaRoi, warpedImg);
+			}
+		}
+		image.releasePixels();
+
+		//keyframe once the view has moved on from the newest keyframe
+		if (placed) {
+			int newestKeyframe = keyframes.empty() ? -1 : keyframes.back();
+			int sharedInliers = 0;
+			for (int c = 0; c < candidates.size(); c++) {
+				if (candidates[c] == newestKeyframe && !matches[c].homo1.empty()) {
+					sharedInliers = matches[c].ransacInliers;
+				}
+			}
+			if (newestKeyframe < 0 || sharedInliers < STREAM_KEYFRAME_INLIERS) {
+				keyframes.push_back(i);
+			}
+			window.push_back(i);
+		}
+		auto forget = [&](int f) {
+			if (find(window.begin(), window.end(), f) == window.end() && find(keyframes.begin(), keyframes.end(), f) == keyframes.end()) {
+				job->imageSet[f].keypoints = vector<KeyPoint>();
+				job->imageSet[f].descriptors.release();
+				retired.push_back(f);
+			}
+		};
+		if (!placed) {
+			forget(i);
+		}
+		while (window.size() > STREAM_WINDOW) {
+			int f = window.front();
+			window.pop_front();
+			forget(f);
+		}
+		while (keyframes.size() > STREAM_MAX_KEYFRAMES) {
+			int f = keyframes.front();
+			keyframes.pop_front();
+			forget(f);
+		}
+
+		double latency = double(duration_cast<microseconds>(high_resolution_clock::now() - arrived).count()) / 1000;
+		if (placed) {
+			stitched++;
+			totalLatency += latency;
+			maxLatency = max(maxLatency, latency);
+		}
+		else {
+			dropped++;
+		}
+		if (PRINT_CONSOLE_DEBUG) {
+			job->log << "Frame " << frameNumber << " (" << name << "): ";
+			if (!placed) {
+				job->log << "no good match in the window or keyframes, dropped";
+			}
+			else if (frameNumber == 0) {
+				job->log << "reference frame";
+			}
+			else {
+				job->log << "attached to " << job->imageSet[candidates[best]].path << " (score " << matches[best].matchScore << ")";
+			}
+			job->log << ", " << latency << " ms, panorama " << panorama.cols << " x " << panorama.rows << endl;
+		}
+		if (IMAGE_COMPOSITE_DEBUG && placed) {
+			namedWindow("Streaming panorama", WINDOW_NORMAL);
+			imshow("Streaming panorama", panorama);
+			resizeWindow("Streaming panorama", 800, 800);
+			waitKey(1);
+		}
+		frameNumber++;
+	}
+
+	job->log << "Stitched " << stitched << " frames, dropped " << dropped << ", average latency " << totalLatency / max(1, stitched)
+		<< " ms, worst " << maxLatency << " ms" << endl;
+	if (SAVE_OUTPUT && !panorama.empty()) {
+		saveResult(panorama, "CompositeImage.jpg");
+	}
+	if (PRINT_MEMORY_USAGE) {
+		job->log << "Peak resident memory: " << peakResidentBytes() / (1024 * 1024) << " MB" << endl;
+	}
+}
 
+// Next frame of the stream, false if there isn't one yet. Video frames come straight from the decoder,
+// folder frames are the next image file after the source's lastFile in name order once it has stopped growing.
+bool nextStreamFrame(StreamSource& source, Mat& frame, double& remainingScale, string& name) {
+	if (source.folder.empty()) {
+		if (!source.video.read(frame)) {
+			return false;
+		}
+		remainingScale = job->loadScale;
+		name = "frame " + to_string(int(source.video.get(CAP_PROP_POS_FRAMES)) - 1);
+		return true;
+	}
+	try {
+		string next;
+		for (const auto& entry : filesystem::directory_iterator(source.folder)) {
+			string path = entry.path().string();
+			if (entry.is_regular_file() && isImageFile(entry.path()) && path > source.lastFile && (next.empty() || path < next)) {
+				next = path;
+			}
+		}
+		if (next.empty()) {
+			return false;
+		}
+		//a file the capture process is still writing keeps changing size between polls, files that
+		//haven't been touched for a poll interval are taken straight away
+		uintmax_t size = filesystem::file_size(next);
+		bool settled = filesystem::file_time_type::clock::now() - filesystem::last_write_time(next) > milliseconds(STREAM_POLL_MS);
+		if (size == 0 || (!settled && (next != source.pendingFile || size != source.pendingSize))) {
+			source.pendingFile = next;
+			source.pendingSize = size;
+			return false;
+		}
+		source.lastFile = next;
+		name = next;
+		frame = decodeReducedImage(readFileBytes(next), job->loadScale, remainingScale);
+		if (frame.empty()) {
+			job->log << "Could not decode " << next << ", skipping it" << endl;
+			return nextStreamFrame(source, frame, remainingScale, name);
 		}
+		return true;
+	}
+	catch (const std::exception & e) {
+		job->log << e.what() << endl;
+		return false;
 	}
-	return img_1;
 }
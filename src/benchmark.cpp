@@ -0,0 +1,205 @@
+/*	Auto-Stitch Benchmark
+	Runs the pipeline one stage at a time over the bundled image sets, at several scales and image
+	counts, and writes the timings as JSON so releases can be compared.
+
+	autostitch_benchmark [images folder] [output file]
+*/
+
+#define AUTOSTITCH_NO_MAIN
+#include "autostitch.cpp"
+
+/* ------------------------------ Benchmark Settings ------------------------------ */
+
+#define BENCHMARK_REPEATS		3 // Runs per configuration, the median and fastest are reported
+#define BENCHMARK_FOLDERS		{ 2, 3, 4 } // setFolderPath choices: WLH, StJames, Room
+#define BENCHMARK_SCALES		{ 0.15, 0.3, 0.5 } // Matching scales (StitchJob::loadScale)
+#define BENCHMARK_IMAGE_COUNTS	{ 4, 8, 0 } // Images loaded from each set, 0 is the whole set
+
+#if defined(__AVX2__)
+const char* simdKernels = "avx2";
+#else
+const char* simdKernels = "scalar";
+#endif
+const char* stageNames[] = { "decode", "features", "matching", "homography", "warping", "blending" };
+const int stageCount = 6;
+
+struct BenchmarkRun {
+	double micros[stageCount] = {}; // Wall time of each stage
+	int images = 0; // Images loaded
+	int pairs = 0; // Pairs matched
+	int verified = 0; // Pairs with a homography
+	int composited = 0; // Images warped into the canvas
+	Size canvas; // Composite size
+	size_t scratchRequests = 0; // Scratch buffers the run asked the job's pool for
+	size_t scratchAllocations = 0; // How many of those the pool had to allocate
+}; // One pass of the pipeline over one configuration
+
+/* ------------------------------ Function Protocols ------------------------------ */
+
+BenchmarkRun runPipeline(string folder, double scale, int count);
+void writeConfiguration(ostream& out, string set, double scale, const vector<BenchmarkRun>& runs);
+
+/* --------------------------------- Main Routine ------------------------------------- */
+
+int main(int argc, char* argv[]) {
+	string imagesFolder = argc > 1 ? argv[1] : "images";
+	string outputFile = argc > 2 ? argv[2] : "benchmark.json";
+
+	ofstream out(outputFile);
+	if (!out) {
+		cerr << "Can't write " << outputFile << endl;
+		return 1;
+	}
+	out << "{\n  \"opencv\": \"" << CV_VERSION << "\",\n  \"threads\": " << workerPool.size()
+		<< ",\n  \"simd\": \"" << simdKernels << "\",\n  \"repeats\": " << BENCHMARK_REPEATS
+		<< ",\n  \"lazyImagePixels\": " << LAZY_IMAGE_PIXELS << ",\n  \"projection\": " << PROJECTION
+		<< ",\n  \"configurations\": [";
+
+	//the pipeline's own progress output would swamp the results, it goes nowhere
+	job->log.rdbuf(nullptr);
+	bool first = true;
+	for (int folder : BENCHMARK_FOLDERS) {
+		setFolderPath(folder);
+		string set = job->folderPath;
+		string path = imagesFolder + "/" + set;
+		if (!filesystem::is_directory(path)) {
+			cerr << "Skipping " << set << ", " << path << " is missing" << endl;
+			continue;
+		}
+		int setSize = 0;
+		for (const auto& entry : filesystem::directory_iterator(path)) {
+			setSize += entry.is_regular_file() && isImageFile(entry.path());
+		}
+		for (double scale : BENCHMARK_SCALES) {
+			vector<int> imageCountsRun;
+			for (int count : BENCHMARK_IMAGE_COUNTS) {
+				//a count past the size of the set runs the same configuration as the whole set
+				int images = count <= 0 ? setSize : min(count, setSize);
+				if (find(imageCountsRun.begin(), imageCountsRun.end(), images) != imageCountsRun.end()) {
+					continue;
+				}
+				imageCountsRun.push_back(images);
+				vector<BenchmarkRun> runs;
+				for (int repeat = 0; repeat < BENCHMARK_REPEATS; repeat++) {
+					runs.push_back(runPipeline(path, scale, count));
+				}
+				out << (first ? "\n" : ",\n");
+				writeConfiguration(out, set, scale, runs);
+				first = false;
+				cerr << set << " at " << scale << " with " << runs[0].images << " images done" << endl;
+			}
+		}
+	}
+	out << "\n  ]\n}\n";
+	return out.good() ? 0 : 1;
+}
+
+/* ----------------------------- Function Implementations ------------------------------*/
+
+// Loads count images of folder at scale and takes them through Steps 1 to 3 the way main does, timing
+// each stage on its own. Work a stage needs that belongs to another one (pixels reloaded by
+// LAZY_IMAGE_PIXELS, the assembly plan) is done between the timers. The composite stays at the
+// matching scale, so the warp and blend timings follow the matching scale.
+BenchmarkRun runPipeline(string folder, double scale, int count) {
+	BenchmarkRun run;
+	job->loadScale = scale;
+	job->pixelScale = scale;
+	job->imagesToLoad = count;
+	job->imageSet.clear();
+	job->imagesInComposite.clear();
+	job->compositeImagePath.clear();
+	ScratchPool::Stats scratchBefore = job->scratch->stats();
+
+	auto mark = high_resolution_clock::now();
+	auto lap = [&](int stage) {
+		auto now = high_resolution_clock::now();
+		run.micros[stage] = double(duration_cast<microseconds>(now - mark).count());
+		mark = now;
+	};
+	auto skip = [&]() { mark = high_resolution_clock::now(); };
+
+	if (!importImages(folder) || job->imageSet.empty()) {
+		return run;
+	}
+	run.images = int(job->imageSet.size());
+	lap(0);
+
+	for (int i = 0; i < job->imageSet.size(); i++) {
+		ensurePixels(i);
+	}
+	skip();
+	workerPool.parallelFor(int(job->imageSet.size()), [&](int i) {
+		computeFeatures(i);
+	});
+	lap(1);
+
+	vector<PairMatch> pairMatches = selectCandidatePairs();
+	workerPool.parallelFor(int(pairMatches.size()), [&](int p) {
+		pairMatches[p] = FindMatches(pairMatches[p].img1indx, pairMatches[p].img2indx);
+	});
+	run.pairs = int(pairMatches.size());
+	lap(2);
+
+	workerPool.parallelFor(int(pairMatches.size()), [&](int p) {
+		if (pairMatches[p].matchScore < job->imageMatchingThreshold + 50) {
+			solveTransforms(pairMatches[p]);
+		}
+	});
+	lap(3);
+
+	job->matchGraph.build(int(job->imageSet.size()), pairMatches);
+	run.verified = job->matchGraph.edgeCount();
+	int centerimgIndex = findCenterImage();
+	job->compositeImagePath = generateAssemblyPath(centerimgIndex);
+	Rect canvas = planCanvas(centerimgIndex);
+	run.composited = int(job->imagesInComposite.size());
+	run.canvas = canvas.size();
+	skip();
+	vector<Mat> warped(job->imagesInComposite.size());
+	vector<Rect> rois(job->imagesInComposite.size());
+	workerPool.parallelFor(int(job->imagesInComposite.size()), [&](int k) {
+		warped[k] = warpToCanvas(job->imagesInComposite[k], canvas.tl(), canvas.size(), rois[k]);
+	});
+	lap(4);
+
+	Mat accumulator = Mat::zeros(canvas.height, canvas.width, CV_32SC4);
+	vector<mutex> bandLocks((canvas.height + BLEND_ROWS_PER_TASK - 1) / BLEND_ROWS_PER_TASK);
+	workerPool.parallelFor(int(job->imagesInComposite.size()), [&](int k) {
+		if (!rois[k].empty()) {
+			accumulateImage(accumulator, warped[k], rois[k], &bandLocks);
+		}
+	});
+	Mat composite;
+	normalizeAccumulator(accumulator, composite);
+	lap(5);
+
+	ScratchPool::Stats scratchAfter = job->scratch->stats();
+	run.scratchRequests = scratchAfter.requests - scratchBefore.requests;
+	run.scratchAllocations = scratchAfter.allocations - scratchBefore.allocations;
+	job->imageSet.clear();
+	return run;
+}
+
+// One entry of the configurations array: the setup, what the first run produced, the scratch buffers the
+// last (warm) run still had to allocate, and per stage the median and fastest of the runs in microseconds
+void writeConfiguration(ostream& out, string set, double scale, const vector<BenchmarkRun>& runs) {
+	const BenchmarkRun& first = runs[0];
+	out << "    {\n      \"set\": \"" << set << "\", \"scale\": " << scale << ", \"images\": " << first.images
+		<< ", \"pairs\": " << first.pairs << ", \"verifiedPairs\": " << first.verified
+		<< ", \"composited\": " << first.composited << ", \"canvas\": [" << first.canvas.width << ", " << first.canvas.height << "],\n"
+		<< "      \"scratchRequests\": " << runs.back().scratchRequests << ", \"scratchAllocations\": " << runs.back().scratchAllocations << ",\n"
+		<< "      \"stages\": {";
+	double medianTotal = 0;
+	for (int stage = 0; stage < stageCount; stage++) {
+		vector<double> micros;
+		for (const BenchmarkRun& run : runs) {
+			micros.push_back(run.micros[stage]);
+		}
+		sort(micros.begin(), micros.end());
+		double median = micros[micros.size() / 2];
+		medianTotal += median;
+		out << (stage == 0 ? "\n" : ",\n") << "        \"" << stageNames[stage] << "\": { \"medianMicros\": " << (long long)median
+			<< ", \"minMicros\": " << (long long)micros[0] << " }";
+	}
+	out << "\n      },\n      \"totalMedianMicros\": " << (long long)medianTotal << "\n    }";
+}
@@ -0,0 +1,33 @@
+# Runs one folder through the service at two scales, then each scale on its own fresh copy of the folder.
+# The features cached by the first scale must not be reused at the second, so both composites have to
+# match the ones stitched without a cache. Called by ctest with AUTOSTITCH, IMAGES and WORK set.
+
+file(REMOVE_RECURSE ${WORK})
+foreach(copy shared small large)
+	file(MAKE_DIRECTORY ${WORK}/${copy})
+	file(GLOB images ${IMAGES}/*.jpg)
+	file(COPY ${images} DESTINATION ${WORK}/${copy})
+endforeach()
+
+function(run_service jobs)
+	file(WRITE ${WORK}/jobs.txt "${jobs}")
+	execute_process(COMMAND ${AUTOSTITCH} --service
+		INPUT_FILE ${WORK}/jobs.txt
+		WORKING_DIRECTORY ${WORK}
+		OUTPUT_VARIABLE status
+		RESULT_VARIABLE failed)
+	if(failed)
+		message(FATAL_ERROR "service jobs failed:\n${status}")
+	endif()
+endfunction()
+
+run_service("shared scale=0.25 threshold=3550 output=shared-small.jpg\nshared scale=0.5 threshold=3550 output=shared-large.jpg\n")
+run_service("small scale=0.25 threshold=3550 output=small.jpg\nlarge scale=0.5 threshold=3550 output=large.jpg\n")
+
+foreach(scale small large)
+	execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/shared-${scale}.jpg ${WORK}/${scale}.jpg
+		RESULT_VARIABLE different)
+	if(different)
+		message(FATAL_ERROR "the ${scale} scale composite depends on the scale the folder was stitched at before")
+	endif()
+endforeach()